@@ -29,13 +29,35 @@ plt_savefig and plt_show depend on the backend (PNG, BMP, SDL, etc.).
 #include <ft_maki.h>
 #include <ft_ndarray.h>
 #define STB_IMAGE_WRITE_IMPLEMENTATION
+#ifdef FT_MATPLOTLIB_USE_ZLIB
+// stb's PNG writer compresses with the system zlib too
+unsigned char *plt_zlib_compress(unsigned char *data, int len, int *out_len,
+                                 int level);
+#define STBIW_ZLIB_COMPRESS plt_zlib_compress
+#endif
 #include "font8x8_basic.h"
 #include "stb_image_write.h"
 
 // Core
+typedef struct s_display_list DisplayList;
+
+typedef struct {
+  int x, y, w, h;
+} Rect;
+
+// pixels written since the last plt_damage_reset, as up to 16 rectangles
+#define PLT_DAMAGE_MAX_RECTS 16
+typedef struct {
+  Rect rects[PLT_DAMAGE_MAX_RECTS];
+  int nrects;
+} Damage;
+
 typedef struct {
   int width, height;
   unsigned char *pixels;
+  DisplayList *record; // list the calls are recorded into, or NULL
+  Damage *damage;      // dirty rectangles, NULL when not tracked
+  int clip_y0, clip_y1; // if clip_y1 > 0, rows drawn are [clip_y0, clip_y1)
 } Canvas;
 
 typedef struct {
@@ -59,6 +81,65 @@ typedef struct {
   int max_items;
 } Legend;
 
+// Histogram counts, computed once and drawn any number of times
+typedef struct {
+  int bins;
+  double xmin, xmax;
+  long *counts;
+  long total; // values that fell inside [xmin, xmax]
+} Histogram;
+
+/*
+    Mergeable quantile sketch (t-digest). Memory depends only on the
+    compression (about that many centroids plus a 5x insert buffer).
+*/
+typedef struct {
+  double compression;
+  double *means, *weights; // centroids sorted by mean
+  int ncent, cap;
+  double *buf_means, *buf_weights; // points not merged yet
+  int nbuf, buf_cap;
+  void *scratch;
+  double total, min, max;
+} QuantileSketch;
+
+/*
+    Cached statistics of one axis of a Series. valid tells which of them
+    are current; the rest are recomputed on the next read.
+*/
+#define PLT_STAT_RANGE 1  // min, max, nans
+#define PLT_STAT_SORTED 2 // sorted
+#define PLT_LOD_MAX_LEVELS 40
+
+typedef struct {
+  double min, max; // NaNs ignored
+  long nans;
+  int sorted; // non-decreasing and NaN-free
+  int valid;
+} SeriesStats;
+
+// x/y pair with cached statistics and an optional min/max pyramid of y
+typedef struct {
+  ndarray *x, *y;
+  long n;
+  SeriesStats xstats, ystats;
+  int lod_enabled, lod_valid, lod_levels;
+  double *lod_min[PLT_LOD_MAX_LEVELS], *lod_max[PLT_LOD_MAX_LEVELS];
+  long lod_len[PLT_LOD_MAX_LEVELS];
+} Series;
+
+// Colormap: 256-entry lookup table, values are mapped to an index once
+typedef struct {
+  Color lut[256];
+} Colormap;
+
+/*
+    Worker threads used by the parallel paths (histograms, reductions...).
+    0 means one per online CPU, which is the default.
+*/
+void plt_set_threads(int n);
+int plt_get_threads(void);
+
 // Auxiliary drawing functions
 void set_pixel(Canvas *c, int x, int y, Color col);
 void draw_line(Canvas *c, int x0, int y0, int x1, int y1, Color col);
@@ -69,16 +150,60 @@ void draw_rect(Canvas *c, int x, int y, int w, int h, Color col);
     Bresenham circle algorithm, but adapted to fill
 */
 void draw_circle(Canvas *c, int cx, int cy, int r, Color col);
+// horizontal span [x0, x1] on row y / vertical span [y0, y1] on column x
+void draw_span(Canvas *c, int x0, int x1, int y, Color col);
+void draw_vspan(Canvas *c, int x, int y0, int y1, Color col);
 void draw_axes(Canvas *c, double xmin, double xmax, double ymin, double ymax);
 
 Canvas *create_canvas(int w, int h);
+
+/*
+    Damage tracking. Once enabled, every drawing function adds the box it
+    touched to c->damage; nearby boxes are merged, so the rectangles cover
+    everything drawn since the last reset. Code writing Canvas.pixels itself
+    reports it with plt_damage_add. plt_anim_frame and plt_encode_damage
+    only look inside the damage: reset it once they have all run.
+*/
+int plt_damage_enable(Canvas *c);
+void plt_damage_disable(Canvas *c);
+void plt_damage_add(Canvas *c, int x, int y, int w, int h);
+void plt_damage_reset(Canvas *c);
+Rect plt_damage_bounds(const Canvas *c); // w == 0 when nothing is damaged
 Legend *legend_create(int max_items);
 void legend_add(Legend *lg, const char *label, Color col);
 void plt_draw_legend(Canvas *c, Legend *lg);
 
+/*
+    Colormaps are built by linear interpolation between evenly spaced stops.
+    colormap_lookup maps t in [0, 1] to a color without any float math
+    beyond one multiply.
+*/
+Colormap *colormap_create(const Color *stops, int nstops);
+Colormap *colormap_viridis(void);
+void colormap_destroy(Colormap *cm);
+Color colormap_lookup(const Colormap *cm, double t);
+
 AxisLimits plt_axis_auto(ndarray *x, ndarray *y);
 AxisLimits plt_axis_auto_multi(ndarray **xs, ndarray **ys, int nplots);
 
+/*
+    Series: the arrays are not copied. Write through plt_series_set to keep
+    the cache current, or call plt_series_invalidate after writing to the
+    arrays directly (or changing their length). axis is 0 for x, 1 for y.
+*/
+Series *plt_series_create(ndarray *x, ndarray *y);
+void plt_series_destroy(Series *s);
+void plt_series_set(Series *s, long i, double xv, double yv);
+void plt_series_invalidate(Series *s);
+void plt_series_enable_lod(Series *s, int on);
+const SeriesStats *plt_series_stats(Series *s, int axis);
+AxisLimits plt_series_limits(Series **series, int nseries);
+/*
+    Line plot of a series. Sorted x draws only the visible range; with LOD
+    enabled, dense ranges are decimated to min/max per pixel column.
+*/
+void plt_series_plot(Canvas *c, Series *s, Color col, AxisLimits lim);
+
 // 1. Line graph
 void plt_plot_ndarray(Canvas *c, ndarray *x, ndarray *y, Color col, double xmin,
                       double xmax, double ymin, double ymax);
@@ -93,6 +218,17 @@ void plt_scatter_ndarray(Canvas *c, ndarray *x, ndarray *y, Color col,
 void plt_scatter_circle_ndarray(Canvas *c, ndarray *x, ndarray *y, Color col,
                                 double xmin, double xmax, double ymin,
                                 double ymax, int radius);
+/*
+    Bubble chart: per-point radius (sizes, in pixels) and color (values mapped
+    through cm over [vmin, vmax]; vmin >= vmax scans values for the range).
+    Points are grouped by rounded radius so each circle stamp is rasterised
+    once; buckets are drawn from the largest radius down so small markers stay
+    visible. sizes/values may be NULL (radius 3 / middle of the colormap).
+*/
+void plt_scatter_sized_ndarray(Canvas *c, ndarray *x, ndarray *y,
+                               ndarray *sizes, ndarray *values, Colormap *cm,
+                               double xmin, double xmax, double ymin,
+                               double ymax, double vmin, double vmax);
 
 // 4. Bar chart
 void plt_bar_ndarray(Canvas *c, ndarray *x, ndarray *height, Color col,
@@ -115,6 +251,90 @@ void plt_hist2(Canvas *c, ndarray *data, int bins, Color col, double xmin,
 void plt_hist_full(Canvas *c, ndarray *data, int bins, Color col,
                    const char *title, const char *xlabel, const char *ylabel);
 
+/*
+    Compute-once histograms. plt_histogram_compute bins data over
+    [xmin, xmax] (xmin >= xmax: data range plus 5%), update adds more data
+    with the same binning, merge adds src into dst when bins and range are
+    identical (returns 0, or -1 otherwise). draw renders like plt_hist.
+*/
+Histogram *plt_histogram_compute(ndarray *data, int bins, double xmin,
+                                 double xmax);
+void plt_histogram_update(Histogram *h, ndarray *new_data);
+int plt_histogram_merge(Histogram *dst, const Histogram *src);
+void plt_histogram_draw(Canvas *c, const Histogram *h, Color col);
+
+/*
+    Histograms are reduced to one value per pixel column before filling, so
+    drawing costs one column fill per pixel however many bins there are.
+    When several bins share a column it shows their maximum (PLT_REDUCE_MAX,
+    what plt_histogram_draw uses) or their sum (PLT_REDUCE_SUM).
+*/
+#define PLT_REDUCE_MAX 0
+#define PLT_REDUCE_SUM 1
+void plt_histogram_draw_columns(Canvas *c, const Histogram *h, Color col,
+                                int reduce);
+void plt_histogram_destroy(Histogram *h);
+
+/*
+    Integer histograms count by direct indexing, one bin per value (centred
+    on the integer, so plt_histogram_draw lines up). plt_histogram_int
+    ignores values outside [vmin, vmax]. plt_hist_categorical draws one bar
+    per bin, shaped like plt_bar_ndarray's, instead of touching columns.
+*/
+Histogram *plt_histogram_u8(const unsigned char *data, long n);
+Histogram *plt_histogram_u16(const unsigned short *data, long n);
+Histogram *plt_histogram_int(const int *data, long n, int vmin, int vmax);
+void plt_hist_categorical(Canvas *c, const Histogram *h, Color col);
+
+/*
+    Streaming histograms of unknown range: a fixed number of bins (rounded up
+    to even) whose range doubles, merging bin pairs, whenever a chunk falls
+    outside it. push accepts any number of chunks; stream_file maps a file of
+    native doubles and pushes it (0 on success, -1 on error). Draw the result
+    with plt_histogram_draw.
+*/
+Histogram *plt_histogram_stream_create(int bins);
+void plt_histogram_stream_push(Histogram *h, const double *chunk, long n);
+int plt_histogram_stream_file(Histogram *h, const char *path);
+
+/*
+    Density of x/y pairs: counts on a dense nx * ny grid (hist2d) or on
+    hexagons, gridsize across x (hexbin), colored through cm (NULL: viridis).
+    xmin >= xmax or ymin >= ymax picks that range from the data.
+*/
+void plt_hist2d(Canvas *c, ndarray *x, ndarray *y, int nx, int ny,
+                Colormap *cm, double xmin, double xmax, double ymin,
+                double ymax);
+void plt_hexbin(Canvas *c, ndarray *x, ndarray *y, int gridsize, Colormap *cm,
+                double xmin, double xmax, double ymin, double ymax);
+
+/*
+    Gaussian kernel density estimate over [xmin, xmax] (xmin >= xmax: data
+    range plus 5%), bandwidth <= 0 uses Silverman's rule. The curve is scaled
+    so its peak reaches the top, matching plt_hist's normalisation.
+*/
+void plt_kde(Canvas *c, ndarray *data, double bandwidth, Color col,
+             double xmin, double xmax);
+
+// 5.1 Distribution summaries
+// compression <= 0 uses 100; add skips NaN and +-inf, is parallel for large
+// inputs and can be called once per streamed chunk; merge folds src into
+// dst (0 on success)
+QuantileSketch *plt_sketch_create(double compression);
+void plt_sketch_add(QuantileSketch *s, const double *v, long n);
+void plt_sketch_add_ndarray(QuantileSketch *s, ndarray *data);
+int plt_sketch_merge(QuantileSketch *dst, QuantileSketch *src);
+long plt_sketch_count(QuantileSketch *s);
+double plt_sketch_quantile(QuantileSketch *s, double q);
+double plt_sketch_cdf(QuantileSketch *s, double x);
+void plt_sketch_destroy(QuantileSketch *s);
+
+// one box/violin per sketch in equal slots; ymin >= ymax picks the range
+void plt_boxplot(Canvas *c, QuantileSketch **groups, int ngroups, Color col,
+                 double ymin, double ymax);
+void plt_violin(Canvas *c, QuantileSketch **groups, int ngroups, Color col,
+                double ymin, double ymax);
+
 // 6. Image (heatmap)
 void plt_imshow(Canvas *c, ndarray *matrix);
 
@@ -127,6 +347,194 @@ void plt_grid(Canvas *c, int on);
 
 // 8. Save and Output
 void plt_savefig(Canvas *c, const char *filename);
+
+/*
+    Deflate backend, same contract as STBIW_ZLIB_COMPRESS: returns a zlib
+    stream allocated with STBIW_MALLOC, or NULL.
+*/
+typedef unsigned char *(*DeflateFn)(unsigned char *data, int len,
+                                    int *out_len, int level);
+unsigned char *plt_deflate_fast(unsigned char *data, int len, int *out_len,
+                                int level); // levels 1-3, fixed Huffman
+unsigned char *plt_deflate_stb(unsigned char *data, int len, int *out_len,
+                               int level);
+
+#define PLT_FILTER_HEURISTIC -1 // best of the five per row (stb, libpng)
+#define PLT_FILTER_NONE 0
+#define PLT_FILTER_SUB 1
+#define PLT_FILTER_UP 2
+#define PLT_FILTER_AVG 3
+#define PLT_FILTER_PAETH 4
+
+/*
+    Output formats. PPM, PAM and RAW are a header plus the canvas bytes
+    (RAW: "PLTR", then width, height, channels as little-endian uint32).
+*/
+#define PLT_FORMAT_AUTO 0 // from the file extension; PNG in memory
+#define PLT_FORMAT_PNG 1
+#define PLT_FORMAT_PPM 2
+#define PLT_FORMAT_PAM 3
+#define PLT_FORMAT_BMP 4
+#define PLT_FORMAT_RAW 5
+#define PLT_FORMAT_QOI 6
+
+typedef struct {
+  int format;        // PLT_FORMAT_*
+  int level;         // 0 (stored) to 9
+  int filter;        // PLT_FILTER_*
+  DeflateFn deflate; // NULL picks one from the level
+  int threads;       // bands encoded in parallel, 0 = plt_get_threads()
+  int palette;       // PNG: indexed when at most 256 colors are used
+  int incremental;   // PNG: reuse unchanged row bands of the last encode
+  double encode_ms;  // out: filtering + compression time
+  long bytes;        // out: size written
+} SaveOptions;
+
+/*
+    plt_save_options gives level 2 with the Up filter and palette mode,
+    several times faster than plt_savefig. opts may be NULL.
+    Large images are split into row bands compressed on separate threads
+    (only with the built-in backends, i.e. deflate == NULL; without zlib
+    they cover levels 1-3 and higher levels are compressed in one piece by
+    stb, never clamped to 3).
+    Returns 0, or -1 on error.
+*/
+SaveOptions plt_save_options(void);
+int plt_savefig_opts(Canvas *c, const char *filename, SaveOptions *opts);
+
+/*
+    Reusable output for in-memory encoding; start from {0} and release with
+    plt_buffer_free. data/len hold the last image encoded into it; scratch
+    keeps the encoder's work buffers so later encodes don't allocate.
+*/
+typedef struct {
+  unsigned char *data;
+  size_t len, cap;
+  void *scratch;
+} EncodeBuffer;
+
+int plt_encode_png(Canvas *c, EncodeBuffer *buf, SaveOptions *opts);
+// streams the file through func; work only provides scratch
+int plt_encode_png_to_func(Canvas *c, stbi_write_func *func, void *ctx,
+                           EncodeBuffer *work, SaveOptions *opts);
+// same in the format chosen by opts->format
+int plt_encode(Canvas *c, EncodeBuffer *buf, SaveOptions *opts);
+int plt_encode_to_func(Canvas *c, stbi_write_func *func, void *ctx,
+                       EncodeBuffer *work, SaveOptions *opts);
+void plt_buffer_free(EncodeBuffer *buf);
+/*
+    plt_savefig_opts through the caller's buffer, so its scratch survives
+    from one save to the next. With opts->incremental, PNG encodes into the
+    same buffer keep each 16-row band compressed and only redo the bands
+    whose pixels changed (built-in compressors only, i.e. deflate == NULL;
+    without zlib they go no higher than level 3, so larger levels are
+    compressed as level 3 on this path).
+*/
+int plt_savefig_buffer(Canvas *c, const char *filename, EncodeBuffer *work,
+                       SaveOptions *opts);
+/*
+    Delta of the damaged area for a viewer that keeps the previous frame:
+    "PLTU", width, height and rectangle count, then x, y, w, h and the w*h
+    RGB pixels of each rectangle (integers little-endian uint32).
+*/
+int plt_encode_damage(Canvas *c, EncodeBuffer *buf);
+
+/*
+    Asynchronous saves. plt_savefig_async snapshots the canvas and returns;
+    a pool of encoder threads (started on first use, or by
+    plt_save_queue_init) writes the file. Submitting blocks while depth jobs
+    are already waiting. Every handle must be passed to plt_save_wait (which
+    returns the save's 0/-1) or plt_save_release. plt_flush waits for all
+    submitted saves and returns how many failed since the last flush.
+*/
+typedef struct s_save_handle SaveHandle;
+
+int plt_save_queue_init(int nthreads, int depth); // 0, 0 for defaults
+SaveHandle *plt_savefig_async(Canvas *c, const char *filename,
+                              const SaveOptions *opts);
+int plt_save_done(SaveHandle *h); // 1 when finished, 0 if not, -1 for NULL
+int plt_save_wait(SaveHandle *h);
+void plt_save_release(SaveHandle *h);
+int plt_flush(void);
+int plt_save_queue_shutdown(void); // flush, stop the threads, return failures
+
+/*
+    Batch rendering of many independent figures. A Batch keeps one width x
+    height canvas and one EncodeBuffer per worker thread (nthreads, 0 =
+    plt_get_threads()). plt_batch_run calls every job's fn on a work-stealing
+    pool with a white canvas and the worker's buffer, typically ending in
+    plt_savefig_buffer(c, name, work, opts); fn must not free either. Inside
+    fn the library's own parallel paths run on one thread. Each job gets
+    fn's result (0, or -1 on failure), its time and the worker that ran it.
+    Returns the number of failed jobs, or -1 on invalid arguments.
+*/
+typedef struct s_batch Batch;
+typedef int (*BatchFn)(Canvas *c, EncodeBuffer *work, void *user);
+
+typedef struct {
+  BatchFn fn;
+  void *user;
+  int result; // out: fn's return value
+  double ms;  // out: time spent in fn
+  int worker; // out: index of the worker that ran it
+} BatchJob;
+
+Batch *plt_batch_create(int nthreads, int width, int height);
+long plt_batch_run(Batch *b, BatchJob *jobs, long njobs);
+void plt_batch_destroy(Batch *b);
+
+/*
+    Animations: each frame only stores the rectangle that changed since the
+    previous one. delay_ms is how long the frame stays on screen; loops is
+    the repeat count (0 = forever). GIF frames with more than 256 colors in
+    the changed rectangle are reduced to a 6x6x6 color cube.
+*/
+#define PLT_ANIM_AUTO 0 // GIF for a .gif file name, APNG otherwise
+#define PLT_ANIM_APNG 1
+#define PLT_ANIM_GIF 2
+
+typedef struct s_animation Animation;
+
+Animation *plt_anim_open(const char *filename, int w, int h, int format,
+                         int loops);
+int plt_anim_frame(Animation *a, Canvas *c, int delay_ms);
+int plt_anim_close(Animation *a);
+
+/*
+    Raw video: frames are written back to back with no header, as ffmpeg's
+    rawvideo input expects (-f rawvideo -pix_fmt rgb24|rgba -s WxH). fd stays
+    owned by the caller and should be blocking; plt_stream_close frees the
+    stream and returns the number of frames written.
+*/
+#define PLT_STREAM_RGB24 0 // written straight from Canvas.pixels
+#define PLT_STREAM_RGBA 1  // opaque alpha added
+
+typedef struct s_stream Stream;
+
+Stream *plt_stream_open(int fd, int w, int h, int format);
+int plt_stream_write(Stream *s, const Canvas *c);
+long plt_stream_close(Stream *s);
+
+/*
+    Display lists. Between plt_record_begin and plt_record_end the line,
+    scatter, title/label, legend and axes calls on c are also stored in dl,
+    in data coordinates, with lines decimated to four vertices per quarter
+    pixel column of c (record at the largest size you need, or at least a
+    quarter of it). Other calls draw but are not recorded. replay draws the
+    list onto a canvas of any size; save/load use a native byte order file.
+    A large canvas is replayed in row bands across worker threads, with the
+    same pixels as one thread.
+    Functions returning int give 0, or -1 on error.
+*/
+DisplayList *plt_displaylist_create(void);
+void plt_displaylist_destroy(DisplayList *dl);
+void plt_displaylist_clear(DisplayList *dl);
+long plt_displaylist_count(const DisplayList *dl); // commands stored
+void plt_record_begin(Canvas *c, DisplayList *dl);
+void plt_record_end(Canvas *c);
+int plt_displaylist_replay(const DisplayList *dl, Canvas *c);
+int plt_displaylist_save(const DisplayList *dl, const char *path);
+DisplayList *plt_displaylist_load(const char *path);
 void plt_show(Canvas *c);
 
 // title, legends, axis
@@ -1,12 +1,626 @@
 #include "../include/ft_matplotlib.h"
 #include <ft_maki.h>
 #include <ft_ndarray.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#ifdef FT_MATPLOTLIB_USE_ZLIB
+#include <zlib.h>
+#endif
+
+/*
+
+Threads.
+
+parallel_for splits [0, n) into nworkers contiguous chunks, runs chunk 0 on
+the calling thread and the others on short-lived pthreads. Workers are told
+their index so they can write into per-thread scratch without locking. If a
+thread cannot be created its chunk simply runs on the caller.
+
+*/
+
+#define PLT_MAX_THREADS 64
+
+static int g_plt_threads = 0; // 0 -> one per online CPU
+static __thread int g_plt_serial = 0; // set on batch workers, see plt_batch_run
+
+void plt_set_threads(int n) { g_plt_threads = n > 0 ? n : 0; }
+
+int plt_get_threads(void) {
+  if (g_plt_serial)
+    return (1);
+  int n = g_plt_threads;
+  if (n <= 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    n = cpus > 0 ? (int)cpus : 1;
+  }
+  return (n > PLT_MAX_THREADS ? PLT_MAX_THREADS : n);
+}
+
+// how many workers are worth starting for n items of at least grain each
+static int parallel_workers(long n, long grain) {
+  long nw = grain > 0 ? n / grain : n;
+  int max = plt_get_threads();
+  if (nw > max)
+    nw = max;
+  return (nw < 1 ? 1 : (int)nw);
+}
+
+typedef void (*t_task_fn)(void *arg, int tid, long start, long end);
+
+typedef struct {
+  t_task_fn fn;
+  void *arg;
+  int tid;
+  long start, end;
+} t_task;
+
+static void *task_main(void *p) {
+  t_task *t = p;
+  t->fn(t->arg, t->tid, t->start, t->end);
+  return (NULL);
+}
+
+static void parallel_for(long n, int nworkers, t_task_fn fn, void *arg) {
+  if (nworkers > PLT_MAX_THREADS)
+    nworkers = PLT_MAX_THREADS;
+  if (nworkers <= 1 || n < nworkers) {
+    fn(arg, 0, 0, n);
+    return;
+  }
+  t_task tasks[PLT_MAX_THREADS];
+  pthread_t th[PLT_MAX_THREADS];
+  int started[PLT_MAX_THREADS];
+
+  for (int t = 0; t < nworkers; t++) {
+    tasks[t] = (t_task){fn, arg, t, n * t / nworkers, n * (t + 1) / nworkers};
+    started[t] = 0;
+  }
+  for (int t = 1; t < nworkers; t++)
+    started[t] = pthread_create(&th[t], NULL, task_main, &tasks[t]) == 0;
+  task_main(&tasks[0]);
+  for (int t = 1; t < nworkers; t++) {
+    if (started[t])
+      pthread_join(th[t], NULL);
+    else
+      task_main(&tasks[t]);
+  }
+}
+
+/*
+
+Min/max reduction.
+
+minmax_f64 keeps independent min and max lanes and relies on MINPD/MAXPD
+returning their second operand when the first is NaN, so NaNs never reach
+the accumulators; a separate unordered compare counts them. Without SSE2
+the same select form (NaN compares false) runs on four scalar lanes.
+minmax_reduce cuts any number of arrays into fixed-size segments, reduces
+the segments on the worker threads and folds the results per axis, so one
+huge series and many small ones both spread over all cores.
+
+*/
+
+#define PLT_MINMAX_SEGMENT (1L << 20)
+#define PLT_MINMAX_GRAIN (1L << 18)
+
+static void minmax_f64(const double *v, long n, double *lo, double *hi,
+                       long *nans) {
+  long i = 0, nan_count = 0;
+  double mn = 1.0 / 0.0, mx = -1.0 / 0.0;
+#if defined(__SSE2__)
+  __m128d lo0 = _mm_set1_pd(mn), lo1 = lo0;
+  __m128d hi0 = _mm_set1_pd(mx), hi1 = hi0;
+  for (; i + 4 <= n; i += 4) {
+    __m128d a = _mm_loadu_pd(v + i);
+    __m128d b = _mm_loadu_pd(v + i + 2);
+    lo0 = _mm_min_pd(a, lo0);
+    lo1 = _mm_min_pd(b, lo1);
+    hi0 = _mm_max_pd(a, hi0);
+    hi1 = _mm_max_pd(b, hi1);
+    int mask = _mm_movemask_pd(_mm_cmpunord_pd(a, a)) |
+               (_mm_movemask_pd(_mm_cmpunord_pd(b, b)) << 2);
+    nan_count += __builtin_popcount(mask);
+  }
+  double l[4], h[4];
+  _mm_storeu_pd(l, _mm_min_pd(lo0, lo1));
+  _mm_storeu_pd(h, _mm_max_pd(hi0, hi1));
+  mn = l[0] < l[1] ? l[0] : l[1];
+  mx = h[0] > h[1] ? h[0] : h[1];
+#else
+  double l[4] = {mn, mn, mn, mn}, h[4] = {mx, mx, mx, mx};
+  for (; i + 4 <= n; i += 4) {
+    for (int k = 0; k < 4; k++) {
+      double x = v[i + k];
+      l[k] = x < l[k] ? x : l[k];
+      h[k] = x > h[k] ? x : h[k];
+      nan_count += x != x;
+    }
+  }
+  for (int k = 0; k < 4; k++) {
+    mn = l[k] < mn ? l[k] : mn;
+    mx = h[k] > mx ? h[k] : mx;
+  }
+#endif
+  for (; i < n; i++) {
+    mn = v[i] < mn ? v[i] : mn;
+    mx = v[i] > mx ? v[i] : mx;
+    nan_count += v[i] != v[i];
+  }
+  *lo = mn;
+  *hi = mx;
+  *nans = nan_count;
+}
+
+typedef struct {
+  const double *v;
+  long n;
+  int axis;
+  double lo, hi;
+  long nans;
+} t_minmax_seg;
+
+static void minmax_task(void *arg, int tid, long start, long end) {
+  t_minmax_seg *seg = arg;
+  (void)tid;
+  for (long s = start; s < end; s++)
+    minmax_f64(seg[s].v, seg[s].n, &seg[s].lo, &seg[s].hi, &seg[s].nans);
+}
+
+/*
+    Reduces narr arrays; array k contributes to axis[k] (0 or 1). lo/hi/nans
+    are indexed by axis and start at +inf/-inf/0, so an axis without any
+    number keeps lo > hi.
+*/
+static void minmax_reduce(const double **v, const long *len, const int *axis,
+                          int narr, double lo[2], double hi[2],
+                          long nans[2]) {
+  lo[0] = lo[1] = 1.0 / 0.0;
+  hi[0] = hi[1] = -1.0 / 0.0;
+  nans[0] = nans[1] = 0;
+
+  long nseg = 0, total = 0;
+  for (int k = 0; k < narr; k++) {
+    if (v[k] && len[k] > 0) {
+      nseg += (len[k] + PLT_MINMAX_SEGMENT - 1) / PLT_MINMAX_SEGMENT;
+      total += len[k];
+    }
+  }
+  if (nseg == 0)
+    return;
+  t_minmax_seg one;
+  t_minmax_seg *seg = nseg == 1 ? &one : ft_malloc(sizeof(*seg) * nseg);
+  if (!seg)
+    return;
+  long s = 0;
+  for (int k = 0; k < narr; k++) {
+    if (!v[k] || len[k] <= 0)
+      continue;
+    for (long off = 0; off < len[k]; off += PLT_MINMAX_SEGMENT) {
+      long m = len[k] - off < PLT_MINMAX_SEGMENT ? len[k] - off
+                                                 : PLT_MINMAX_SEGMENT;
+      seg[s++] = (t_minmax_seg){v[k] + off, m, axis[k], 0, 0, 0};
+    }
+  }
+
+  int nw = parallel_workers(total, PLT_MINMAX_GRAIN);
+  parallel_for(nseg, nw < nseg ? nw : (int)nseg, minmax_task, seg);
+  for (s = 0; s < nseg; s++) {
+    int a = seg[s].axis;
+    lo[a] = seg[s].lo < lo[a] ? seg[s].lo : lo[a];
+    hi[a] = seg[s].hi > hi[a] ? seg[s].hi : hi[a];
+    nans[a] += seg[s].nans;
+  }
+  if (seg != &one)
+    ft_free(seg);
+}
+
+// growable byte buffer on STBIW_REALLOC, released with STBIW_FREE
+typedef struct {
+  unsigned char *data;
+  size_t len, cap;
+} t_bytes;
+
+static int bytes_reserve(t_bytes *b, size_t extra) {
+  if (b->len + extra <= b->cap)
+    return (0);
+  size_t cap = b->cap ? b->cap : 4096;
+  while (cap < b->len + extra)
+    cap *= 2;
+  unsigned char *p = STBIW_REALLOC(b->data, cap);
+  if (!p)
+    return (-1);
+  b->data = p;
+  b->cap = cap;
+  return (0);
+}
+
+static int bytes_put(t_bytes *b, const void *src, size_t n) {
+  if (bytes_reserve(b, n) < 0)
+    return (-1);
+  ft_memcpy(b->data + b->len, src, n);
+  b->len += n;
+  return (0);
+}
+
+/*
+
+Display lists.
+
+While a canvas records into a DisplayList (plt_record_begin), the line,
+scatter, title/label, legend and axes calls append a command before drawing.
+Commands sit back to back in one buffer: a t_dl_cmd header, then x/y pairs
+of doubles in data space or a NUL-terminated string, padded to 8 bytes, so
+the buffer is also the file format.
+
+Lines are decimated while recording: consecutive vertices in the same
+quarter-pixel column of the recording canvas are reduced to the first,
+lowest, highest and last one. Quarter columns nest inside pixel columns, and
+the polyline run compressor draws those four exactly like the full run, so a
+replay at the recorded size gives the same pixels, and replays up to four
+times wider still see every local extreme. Markers drop consecutive points
+that land on the same pixel.
+
+*/
+
+#define PLT_DL_OVERSAMPLE 4 // line decimation columns per recorded pixel
+#define PLT_DL_LINE 1
+#define PLT_DL_MARKERS 2
+#define PLT_DL_TITLE 3
+#define PLT_DL_XLABEL 4
+#define PLT_DL_YLABEL 5
+#define PLT_DL_LEGEND_ITEM 6
+#define PLT_DL_LEGEND_TEXT 7
+#define PLT_DL_DRAW_AXES 8
+#define PLT_DL_AXES 9
+#define PLT_DL_AXES2 10
+
+struct s_display_list {
+  t_bytes buf;
+  long ncmds;
+  int failed; // a command could not be stored, the list is incomplete
+};
+
+typedef struct {
+  unsigned int type;
+  unsigned int size; // header and payload, a multiple of 8
+  Color col;
+  int arg;         // marker radius (-1: 3x3 square), tick count, legend row
+  AxisLimits lim;  // data limits; text position as canvas fractions
+  long n;          // vertices, or string bytes with the NUL
+} t_dl_cmd;
+
+static long dl_open(DisplayList *dl, int type, Color col, int arg,
+                    AxisLimits lim) {
+  if (dl->failed)
+    return (-1);
+  t_dl_cmd cmd;
+  ft_memset(&cmd, 0, sizeof(cmd));
+  cmd.type = (unsigned int)type;
+  cmd.col = col;
+  cmd.arg = arg;
+  cmd.lim = lim;
+  long off = (long)dl->buf.len;
+  if (bytes_put(&dl->buf, &cmd, sizeof(cmd)) < 0) {
+    dl->failed = 1;
+    return (-1);
+  }
+  return (off);
+}
+
+static void dl_put(DisplayList *dl, const void *p, size_t n) {
+  if (!dl->failed && bytes_put(&dl->buf, p, n) < 0)
+    dl->failed = 1;
+}
+
+static void dl_close(DisplayList *dl, long off, long n) {
+  static const unsigned char zero[8];
+  if (off < 0)
+    return;
+  dl_put(dl, zero, (8 - (dl->buf.len & 7)) & 7);
+  if (dl->failed) {
+    dl->buf.len = (size_t)off;
+    ft_printf("Error: display list out of memory, recording stopped\n");
+    return;
+  }
+  t_dl_cmd *cmd = (t_dl_cmd *)(dl->buf.data + off);
+  cmd->size = (unsigned int)(dl->buf.len - (size_t)off);
+  cmd->n = n;
+  dl->ncmds++;
+}
+
+// text commands; pos is only used by the ones placed in canvas fractions
+static void dl_text(Canvas *c, int type, const char *text, Color col, int arg,
+                    AxisLimits pos) {
+  if (!c->record)
+    return;
+  size_t n = ft_strlen(text) + 1;
+  long off = dl_open(c->record, type, col, arg, pos);
+  if (off >= 0)
+    dl_put(c->record, text, n);
+  dl_close(c->record, off, (long)n);
+}
+
+static void dl_simple(Canvas *c, int type, Color col, int arg, AxisLimits lim) {
+  if (c->record)
+    dl_close(c->record, dl_open(c->record, type, col, arg, lim), 0);
+}
+
+/*
+    Vertex recorder for one line or marker command. For lines, v holds the
+    first, lowest, highest and last vertex of the open column.
+*/
+typedef struct {
+  double x, y;
+  long i;
+} t_dl_vtx;
+
+typedef struct {
+  DisplayList *dl; // NULL when the canvas is not recording
+  long off, n, i;
+  int width, height;
+  AxisLimits lim;
+  int px, py, open;
+  t_dl_vtx v[4];
+} t_dl_poly;
+
+static void dl_poly_begin(t_dl_poly *r, const Canvas *c, int type, Color col,
+                          int arg, AxisLimits lim) {
+  r->dl = c->record;
+  r->n = r->i = 0;
+  r->open = 0;
+  r->width = c->width;
+  r->height = c->height;
+  r->lim = lim;
+  if (r->dl) {
+    r->off = dl_open(r->dl, type, col, arg, lim);
+    if (r->off < 0)
+      r->dl = NULL;
+  }
+}
+
+static inline void dl_poly_emit(t_dl_poly *r, double x, double y) {
+  double v[2] = {x, y};
+  dl_put(r->dl, v, sizeof(v));
+  r->n++;
+}
+
+// writes the open column's vertices in input order, each once
+static void dl_poly_flush(t_dl_poly *r) {
+  if (!r->open)
+    return;
+  t_dl_vtx *v = r->v;
+  if (v[2].i < v[1].i) {
+    t_dl_vtx t = v[1];
+    v[1] = v[2];
+    v[2] = t;
+  }
+  long last = -1;
+  for (int k = 0; k < 4; k++) {
+    if (v[k].i != last)
+      dl_poly_emit(r, v[k].x, v[k].y);
+    last = v[k].i;
+  }
+  r->open = 0;
+}
+
+static inline void dl_poly_push(t_dl_poly *r, double xv, double yv) {
+  if (!r->dl)
+    return;
+  t_dl_vtx cur = {xv, yv, r->i++};
+  if (xv != xv || yv != yv) { // a NaN breaks the line
+    dl_poly_flush(r);
+    dl_poly_emit(r, xv, yv);
+    return;
+  }
+  double a = (xv - r->lim.xmin) / (r->lim.xmax - r->lim.xmin) * (r->width - 1);
+  int px = (int)(a * PLT_DL_OVERSAMPLE);
+  if (r->open && px == r->px) {
+    if (yv < r->v[1].y)
+      r->v[1] = cur;
+    if (yv > r->v[2].y)
+      r->v[2] = cur;
+    r->v[3] = cur;
+    return;
+  }
+  dl_poly_flush(r);
+  r->px = px;
+  r->open = 1;
+  r->v[0] = r->v[1] = r->v[2] = r->v[3] = cur;
+}
+
+// markers keep every point that moves to another pixel
+static inline void dl_marker_push(t_dl_poly *r, double xv, double yv, int px,
+                                  int py) {
+  if (!r->dl || (r->i > 0 && px == r->px && py == r->py))
+    return;
+  r->i = 1;
+  r->px = px;
+  r->py = py;
+  dl_poly_emit(r, xv, yv);
+}
+
+static void dl_poly_end(t_dl_poly *r) {
+  if (!r->dl)
+    return;
+  dl_poly_flush(r);
+  dl_close(r->dl, r->off, r->n);
+}
+
+DisplayList *plt_displaylist_create(void) {
+  DisplayList *dl = ft_calloc(1, sizeof(DisplayList));
+  if (!dl)
+    ft_printf("Error: plt_displaylist_create out of memory\n");
+  return (dl);
+}
+
+void plt_displaylist_destroy(DisplayList *dl) {
+  if (!dl)
+    return;
+  STBIW_FREE(dl->buf.data);
+  ft_free(dl);
+}
+
+void plt_displaylist_clear(DisplayList *dl) {
+  dl->buf.len = 0;
+  dl->ncmds = 0;
+  dl->failed = 0;
+}
+
+long plt_displaylist_count(const DisplayList *dl) { return (dl->ncmds); }
+
+void plt_record_begin(Canvas *c, DisplayList *dl) { c->record = dl; }
+
+void plt_record_end(Canvas *c) { c->record = NULL; }
+
+/*
+
+Damage tracking.
+
+With tracking on, every primitive adds the clipped bounding box of what it
+draws (a line's box, a glyph cell, a span, a stamp) to c->damage before
+writing pixels, so the per-pixel loops stay untouched. A box that overlaps
+or touches a listed rectangle grows that rectangle; otherwise it takes a
+free slot, and when all are used it is merged into the rectangle whose area
+grows least. The rectangles always cover every pixel written since the last
+reset, possibly with some margin.
+
+*/
+
+static void damage_merge(Damage *d, int x0, int y0, int x1, int y1) {
+  for (int i = 0; i < d->nrects; i++) {
+    Rect *r = &d->rects[i];
+    if (x0 <= r->x + r->w && x1 >= r->x - 1 && y0 <= r->y + r->h &&
+        y1 >= r->y - 1) {
+      int rx1 = r->x + r->w - 1, ry1 = r->y + r->h - 1;
+      r->x = x0 < r->x ? x0 : r->x;
+      r->y = y0 < r->y ? y0 : r->y;
+      r->w = (x1 > rx1 ? x1 : rx1) - r->x + 1;
+      r->h = (y1 > ry1 ? y1 : ry1) - r->y + 1;
+      return;
+    }
+  }
+  if (d->nrects < PLT_DAMAGE_MAX_RECTS) {
+    d->rects[d->nrects++] = (Rect){x0, y0, x1 - x0 + 1, y1 - y0 + 1};
+    return;
+  }
+  int best = 0;
+  long best_growth = -1;
+  for (int i = 0; i < d->nrects; i++) {
+    Rect *r = &d->rects[i];
+    long ux0 = x0 < r->x ? x0 : r->x, uy0 = y0 < r->y ? y0 : r->y;
+    long ux1 = x1 > r->x + r->w - 1 ? x1 : r->x + r->w - 1;
+    long uy1 = y1 > r->y + r->h - 1 ? y1 : r->y + r->h - 1;
+    long growth = (ux1 - ux0 + 1) * (uy1 - uy0 + 1) - (long)r->w * r->h;
+    if (best_growth < 0 || growth < best_growth) {
+      best = i;
+      best_growth = growth;
+    }
+  }
+  d->nrects--;
+  Rect r = d->rects[best];
+  d->rects[best] = d->rects[d->nrects];
+  x0 = x0 < r.x ? x0 : r.x;
+  y0 = y0 < r.y ? y0 : r.y;
+  x1 = x1 > r.x + r.w - 1 ? x1 : r.x + r.w - 1;
+  y1 = y1 > r.y + r.h - 1 ? y1 : r.y + r.h - 1;
+  damage_merge(d, x0, y0, x1, y1); // may now touch another rectangle
+}
+
+// rows the primitives may write: [clip_top, clip_bottom)
+static inline int clip_top(const Canvas *c) {
+  return (c->clip_y1 > 0 && c->clip_y0 > 0 ? c->clip_y0 : 0);
+}
+
+static inline int clip_bottom(const Canvas *c) {
+  return (c->clip_y1 > 0 && c->clip_y1 < c->height ? c->clip_y1 : c->height);
+}
+
+// inclusive corners, in any order; clipped to the canvas
+static inline void damage_add(Canvas *c, int x0, int y0, int x1, int y1) {
+  if (!c->damage)
+    return;
+  if (x0 > x1) {
+    int t = x0;
+    x0 = x1;
+    x1 = t;
+  }
+  if (y0 > y1) {
+    int t = y0;
+    y0 = y1;
+    y1 = t;
+  }
+  int top = clip_top(c), bottom = clip_bottom(c);
+  if (x1 < 0 || y1 < top || x0 >= c->width || y0 >= bottom)
+    return;
+  damage_merge(c->damage, x0 < 0 ? 0 : x0, y0 < top ? top : y0,
+               x1 >= c->width ? c->width - 1 : x1,
+               y1 >= bottom ? bottom - 1 : y1);
+}
+
+int plt_damage_enable(Canvas *c) {
+  if (!c->damage)
+    c->damage = ft_calloc(1, sizeof(Damage));
+  if (!c->damage) {
+    ft_printf("Error: plt_damage_enable out of memory\n");
+    return (-1);
+  }
+  return (0);
+}
+
+void plt_damage_disable(Canvas *c) {
+  ft_free(c->damage);
+  c->damage = NULL;
+}
+
+void plt_damage_add(Canvas *c, int x, int y, int w, int h) {
+  if (w > 0 && h > 0)
+    damage_add(c, x, y, x + w - 1, y + h - 1);
+}
+
+void plt_damage_reset(Canvas *c) {
+  if (c->damage)
+    c->damage->nrects = 0;
+}
+
+Rect plt_damage_bounds(const Canvas *c) {
+  Rect u = {0, 0, 0, 0};
+  if (!c->damage)
+    return (u);
+  for (int i = 0; i < c->damage->nrects; i++) {
+    const Rect *r = &c->damage->rects[i];
+    if (u.w == 0) {
+      u = *r;
+      continue;
+    }
+    int x1 = u.x + u.w > r->x + r->w ? u.x + u.w : r->x + r->w;
+    int y1 = u.y + u.h > r->y + r->h ? u.y + u.h : r->y + r->h;
+    u.x = r->x < u.x ? r->x : u.x;
+    u.y = r->y < u.y ? r->y : u.y;
+    u.w = x1 - u.x;
+    u.h = y1 - u.y;
+  }
+  return (u);
+}
 
 Canvas *create_canvas(int w, int h) {
   Canvas *c = ft_malloc(sizeof(Canvas));
   c->width = w;
   c->height = h;
   c->pixels = ft_malloc(3 * w * h);
+  c->record = NULL;
+  c->damage = NULL;
+  c->clip_y0 = 0;
+  c->clip_y1 = 0;
   ft_memset(c->pixels, 255, 3 * w * h); // white
   return (c);
 }
@@ -27,27 +641,34 @@ void legend_add(Legend *lg, const char *label, Color col) {
   lg->nitems++;
 }
 
-void plt_draw_legend(Canvas *c, Legend *lg) {
-  if (!lg || lg->nitems == 0)
-    return;
-
+// row i of the legend box
+static void legend_item(Canvas *c, int i, const char *label, Color col) {
   int start_x = c->width - 150; // top right corner
   int start_y = 20;
   int line_height = 20;
+  int y = start_y + i * line_height;
 
-  for (int i = 0; i < lg->nitems; i++) {
-    int y = start_y + i * line_height;
+  // color rectangle
+  draw_rect(c, start_x, y, 15, 15, col);
+
+  // label
+  draw_text(c, start_x + 20, y, label, (Color){0, 0, 0});
+}
 
-    // color rectangle
-    draw_rect(c, start_x, y, 15, 15, lg->items[i].col);
+void plt_draw_legend(Canvas *c, Legend *lg) {
+  if (!lg || lg->nitems == 0)
+    return;
 
-    // label
-    draw_text(c, start_x + 20, y, lg->items[i].label, (Color){0, 0, 0});
+  for (int i = 0; i < lg->nitems; i++) {
+    dl_text(c, PLT_DL_LEGEND_ITEM, lg->items[i].label, lg->items[i].col, i,
+            (AxisLimits){0, 0, 0, 0});
+    legend_item(c, i, lg->items[i].label, lg->items[i].col);
   }
 }
 
-void set_pixel(Canvas *c, int x, int y, Color col) {
-  if (x < 0 || y < 0 || x >= c->width || y >= c->height)
+// set_pixel without damage, for primitives that report their whole box
+static inline void put_pixel(Canvas *c, int x, int y, Color col) {
+  if (x < 0 || x >= c->width || y < clip_top(c) || y >= clip_bottom(c))
     return;
   int idx = 3 * (y * c->width + x);
   c->pixels[idx] = col.r;
@@ -55,15 +676,21 @@ void set_pixel(Canvas *c, int x, int y, Color col) {
   c->pixels[idx + 2] = col.b;
 }
 
+void set_pixel(Canvas *c, int x, int y, Color col) {
+  damage_add(c, x, y, x, y);
+  put_pixel(c, x, y, col);
+}
+
 // draw text with font8x8_basic
 void draw_char(Canvas *c, int x, int y, char ch, Color col) {
-  if (ch < 32 || ch > 126)
+  if (ch < 32 || ch > 126 || y + 7 < clip_top(c) || y >= clip_bottom(c))
     return;
+  damage_add(c, x, y, x + 7, y + 7);
   const unsigned char *bitmap = font8x8_basic[ch - 32];
   for (int row = 0; row < 8; row++) {
     for (int colb = 0; colb < 8; colb++) {
       if (bitmap[row] & (1 << colb)) {
-        set_pixel(c, x + colb, y + row, col);
+        put_pixel(c, x + colb, y + row, col);
       }
     }
   }
@@ -77,14 +704,14 @@ void draw_text(Canvas *c, int x, int y, const char *text, Color col) {
   }
 }
 
-// draw line (Bresenham)
-void draw_line(Canvas *c, int x0, int y0, int x1, int y1, Color col) {
+// Bresenham without damage
+static void line_pixels(Canvas *c, int x0, int y0, int x1, int y1, Color col) {
   int dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
   int dy = -abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
   int err = dx + dy, e2;
 
   while (1) {
-    set_pixel(c, x0, y0, col);
+    put_pixel(c, x0, y0, col);
     if (x0 == x1 && y0 == y1)
       break;
     e2 = 2 * err;
@@ -99,26 +726,140 @@ void draw_line(Canvas *c, int x0, int y0, int x1, int y1, Color col) {
   }
 }
 
+// draw line (Bresenham)
+void draw_line(Canvas *c, int x0, int y0, int x1, int y1, Color col) {
+  int top = clip_top(c), bottom = clip_bottom(c);
+  if ((y0 < top && y1 < top) || (y0 >= bottom && y1 >= bottom))
+    return;
+  damage_add(c, x0, y0, x1, y1);
+  line_pixels(c, x0, y0, x1, y1, col);
+}
+
 void draw_rect(Canvas *c, int x, int y, int w, int h, Color col) {
-  for (int j = 0; j < h; j++) {
-    draw_line(c, x, y + j, x + w - 1, y + j, col);
+  if (h > 0) // w <= 0 still draws each row from x to x + w - 1
+    damage_add(c, x, y, x + w - 1, y + h - 1);
+  int j0 = clip_top(c) - y, j1 = clip_bottom(c) - y;
+  for (int j = j0 > 0 ? j0 : 0; j < h && j < j1; j++) {
+    line_pixels(c, x, y + j, x + w - 1, y + j, col);
   }
 }
 
 void draw_circle(Canvas *c, int cx, int cy, int r, Color col) {
-  for (int y = -r; y <= r; y++) {
+  damage_add(c, cx - r, cy - r, cx + r, cy + r);
+  int y0 = clip_top(c) - cy, y1 = clip_bottom(c) - 1 - cy;
+  for (int y = y0 > -r ? y0 : -r; y <= r && y <= y1; y++) {
     for (int x = -r; x <= r; x++) {
       if (x * x + y * y <= r * r) {
         int px = cx + x;
         int py = cy + y;
-        if (px >= 0 && px < c->width && py >= 0 && py < c->height) {
-          set_pixel(c, px, py, col);
+        if (px >= 0 && px < c->width) {
+          put_pixel(c, px, py, col);
         }
       }
     }
   }
 }
 
+// fills [x0, x1] of one row; caller has already clipped and damaged
+static inline void fill_row(Canvas *c, int x0, int x1, int y, Color col) {
+  unsigned char *p = c->pixels + 3 * (y * c->width + x0);
+  for (int x = x0; x <= x1; x++) {
+    p[0] = col.r;
+    p[1] = col.g;
+    p[2] = col.b;
+    p += 3;
+  }
+}
+
+void draw_span(Canvas *c, int x0, int x1, int y, Color col) {
+  if (x0 > x1) {
+    int t = x0;
+    x0 = x1;
+    x1 = t;
+  }
+  if (y < clip_top(c) || y >= clip_bottom(c) || x1 < 0 || x0 >= c->width)
+    return;
+  if (x0 < 0)
+    x0 = 0;
+  if (x1 >= c->width)
+    x1 = c->width - 1;
+  damage_add(c, x0, y, x1, y);
+  fill_row(c, x0, x1, y, col);
+}
+
+void draw_vspan(Canvas *c, int x, int y0, int y1, Color col) {
+  if (y0 > y1) {
+    int t = y0;
+    y0 = y1;
+    y1 = t;
+  }
+  int top = clip_top(c), bottom = clip_bottom(c);
+  if (x < 0 || x >= c->width || y1 < top || y0 >= bottom)
+    return;
+  if (y0 < top)
+    y0 = top;
+  if (y1 >= bottom)
+    y1 = bottom - 1;
+  damage_add(c, x, y0, x, y1);
+  unsigned char *p = c->pixels + 3 * (y0 * c->width + x);
+  for (int y = y0; y <= y1; y++) {
+    p[0] = col.r;
+    p[1] = col.g;
+    p[2] = col.b;
+    p += 3 * c->width;
+  }
+}
+
+// viridis sampled at 8 evenly spaced points
+static const Color g_viridis_stops[] = {
+    {68, 1, 84},    {70, 50, 127},  {54, 92, 141},   {39, 127, 142},
+    {31, 161, 135}, {74, 194, 109}, {159, 218, 58}, {253, 231, 37}};
+
+static void colormap_fill(Colormap *cm, const Color *stops, int nstops) {
+  if (nstops < 2) {
+    Color only = nstops == 1 ? stops[0] : (Color){0, 0, 0};
+    for (int i = 0; i < 256; i++)
+      cm->lut[i] = only;
+    return;
+  }
+  for (int i = 0; i < 256; i++) {
+    double t = (double)i / 255 * (nstops - 1);
+    int k = (int)t;
+    if (k >= nstops - 1)
+      k = nstops - 2;
+    double f = t - k;
+    Color a = stops[k], b = stops[k + 1];
+    cm->lut[i].r = (unsigned char)(a.r + (b.r - a.r) * f + 0.5);
+    cm->lut[i].g = (unsigned char)(a.g + (b.g - a.g) * f + 0.5);
+    cm->lut[i].b = (unsigned char)(a.b + (b.b - a.b) * f + 0.5);
+  }
+}
+
+Colormap *colormap_create(const Color *stops, int nstops) {
+  Colormap *cm = ft_malloc(sizeof(Colormap));
+  if (!cm)
+    return (NULL);
+  colormap_fill(cm, stops, nstops);
+  return (cm);
+}
+
+Colormap *colormap_viridis(void) {
+  return (colormap_create(g_viridis_stops, 8));
+}
+
+void colormap_destroy(Colormap *cm) { ft_free(cm); }
+
+// index into the LUT; NaN and values below 0 map to the first entry
+static inline int colormap_index(double t) {
+  t = t > 0.0 ? t : 0.0;
+  t = t < 1.0 ? t : 1.0;
+  return ((int)(t * 255.0 + 0.5));
+}
+
+Color colormap_lookup(const Colormap *cm, double t) {
+  return (cm->lut[colormap_index(t)]);
+}
+
 // only internal use
 static inline double matplotlib_ceil(double x) {
   long long i = (long long)x;
@@ -131,6 +872,8 @@ static inline double matplotlib_ceil(double x) {
 void draw_axes(Canvas *c, double xmin, double xmax, double ymin, double ymax) {
   Color black = {0, 0, 0};
   Color gray = {220, 220, 220};
+  dl_simple(c, PLT_DL_DRAW_AXES, black, 0,
+            (AxisLimits){xmin, xmax, ymin, ymax});
 
   // pixel origin
   int x0 = (int)((0 - xmin) / (xmax - xmin) * (c->width - 1));
@@ -170,6 +913,7 @@ void draw_axes(Canvas *c, double xmin, double xmax, double ymin, double ymax) {
 }
 
 void plt_axes2(Canvas *c, AxisLimits lim, Color col, int n_ticks) {
+  dl_simple(c, PLT_DL_AXES2, col, n_ticks, lim);
   // axis X
   int y0 =
       (int)((1 - (0 - lim.ymin) / (lim.ymax - lim.ymin)) * (c->height - 1));
@@ -202,6 +946,7 @@ void plt_axes2(Canvas *c, AxisLimits lim, Color col, int n_ticks) {
 }
 
 void plt_title(Canvas *c, const char *text, Color col) {
+  dl_text(c, PLT_DL_TITLE, text, col, 0, (AxisLimits){0, 0, 0, 0});
   int len = ft_strlen(text);
 
   int text_width = 8 * len;            // width in pixels
@@ -211,6 +956,7 @@ void plt_title(Canvas *c, const char *text, Color col) {
 }
 
 void plt_xlabel(Canvas *c, const char *text, Color col) {
+  dl_text(c, PLT_DL_XLABEL, text, col, 0, (AxisLimits){0, 0, 0, 0});
   int len = ft_strlen(text);
 
   int text_width = 8 * len;
@@ -220,12 +966,15 @@ void plt_xlabel(Canvas *c, const char *text, Color col) {
 }
 
 void draw_text_rot90(Canvas *c, int x, int y, const char *text, Color col) {
+  if (y < clip_top(c) || y - 7 >= clip_bottom(c))
+    return;
   while (*text) {
     unsigned char ch = (unsigned char)*text;
     if (ch < 0 || ch > 127)
       ch = '?'; // fallback ASCII
 
     // runs through lines of the letter
+    damage_add(c, x, y - 7, x + 7, y);
     for (int row = 0; row < 8; row++) {
       ft_uint8_t bits = font8x8_basic[ch][row];
 
@@ -234,7 +983,7 @@ void draw_text_rot90(Canvas *c, int x, int y, const char *text, Color col) {
         if (bits & (1 << col_bit)) {
           int px = x + row;     // x rotated
           int py = y - col_bit; // y rotated
-          set_pixel(c, px, py, col);
+          put_pixel(c, px, py, col);
         }
       }
     }
@@ -253,13 +1002,15 @@ void draw_text_rot90_vertical(Canvas *c, int x, int y, const char *text,
       ch = '?'; // fallback ASCII
 
     // Draws letter rotated 90° (clockwise)
-    for (int row = 0; row < 8; row++) {
+    damage_add(c, x, cursor_y - 7, x + 7, cursor_y);
+    int visible = cursor_y >= clip_top(c) && cursor_y - 7 < clip_bottom(c);
+    for (int row = 0; visible && row < 8; row++) {
       ft_uint8_t bits = font8x8_basic[ch][row];
       for (int col_bit = 0; col_bit < 8; col_bit++) {
         if (bits & (1 << col_bit)) {
           int px = x + row;            // letter width
           int py = cursor_y - col_bit; // descending Y axis
-          set_pixel(c, px, py, col);
+          put_pixel(c, px, py, col);
         }
       }
     }
@@ -284,6 +1035,7 @@ Each letter is still rotated 90°, ensuring the matplotlib y-label effect.
 */
 
 void plt_ylabel(Canvas *c, const char *text, Color col) {
+  dl_text(c, PLT_DL_YLABEL, text, col, 0, (AxisLimits){0, 0, 0, 0});
   // copy to buffer to be able to invert
   char buf[256];
   snprintf(buf, sizeof(buf), "%s", text);
@@ -298,17 +1050,22 @@ void plt_ylabel(Canvas *c, const char *text, Color col) {
 }
 
 void plt_legend(Canvas *c, const char *text, int x, int y, Color col) {
+  // the position is kept relative to the canvas size
+  dl_text(c, PLT_DL_LEGEND_TEXT, text, col, 0,
+          (AxisLimits){(double)x / c->width, 0, (double)y / c->height, 0});
   draw_text(c, x + 20, y - 5, text, col);
   draw_line(c, x, y, x + 15, y, col);
 }
 
 // axis
 void plt_axes(Canvas *c, Color col) {
+  dl_simple(c, PLT_DL_AXES, col, 0, (AxisLimits){0, 0, 0, 0});
   draw_line(c, 50, c->height / 2, c->width - 50, c->height / 2, col);
   draw_line(c, c->width / 2, 50, c->width / 2, c->height - 50, col);
 }
 
 void plt_destroy(Canvas *c) {
+  ft_free(c->damage);
   ft_free(c->pixels);
   ft_free(c);
 }
@@ -337,6 +1094,9 @@ static inline double ndarray_get1d(ndarray *arr, int idx) {
 void plt_scatter_ndarray(Canvas *c, ndarray *x, ndarray *y, Color col,
                          double xmin, double xmax, double ymin, double ymax) {
   int n = x->shape[0]; // assuming x and y are the same size
+  t_dl_poly rec;
+  dl_poly_begin(&rec, c, PLT_DL_MARKERS, col, -1,
+                (AxisLimits){xmin, xmax, ymin, ymax});
 
   for (int i = 0; i < n; i++) {
     double xv = ndarray_get1d(x, i);
@@ -347,13 +1107,18 @@ void plt_scatter_ndarray(Canvas *c, ndarray *x, ndarray *y, Color col,
 
     // draws a small square (3x3) representing a point
     draw_rect(c, px - 1, py - 1, 3, 3, col);
+    dl_marker_push(&rec, xv, yv, px, py);
   }
+  dl_poly_end(&rec);
 }
 
 void plt_scatter_circle_ndarray(Canvas *c, ndarray *x, ndarray *y, Color col,
                                 double xmin, double xmax, double ymin,
                                 double ymax, int radius) {
   int n = x->shape[0];
+  t_dl_poly rec;
+  dl_poly_begin(&rec, c, PLT_DL_MARKERS, col, radius,
+                (AxisLimits){xmin, xmax, ymin, ymax});
   for (int i = 0; i < n; i++) {
     double xv = ndarray_get1d(x, i);
     double yv = ndarray_get1d(y, i);
@@ -362,50 +1127,190 @@ void plt_scatter_circle_ndarray(Canvas *c, ndarray *x, ndarray *y, Color col,
     int py = (int)((1 - (yv - ymin) / (ymax - ymin)) * (c->height - 1));
 
     draw_circle(c, px, py, radius, col);
+    dl_marker_push(&rec, xv, yv, px, py);
   }
+  dl_poly_end(&rec);
 }
 
-// Bar Plot
-void plt_bar_ndarray(Canvas *c, ndarray *x, ndarray *height, Color col,
-                     double xmin, double xmax, double ymin, double ymax) {
-  int n = x->shape[0]; // assuming x and height are the same size
-  int bar_width = (int)(c->width / n) * 0.8; // relative width of the bars
+/*
 
-  for (int i = 0; i < n; i++) {
-    double xv = ndarray_get1d(x, i);
-    double hv = ndarray_get1d(height, i);
+Sized scatter: points are counting-sorted by rounded radius, then every bucket
+builds one circle stamp (the half width of each row, same test as draw_circle)
+and blits it at each point of the bucket with fill_row. The per-point work is
+a clip plus 2r+1 span fills, independent of how the stamp was produced.
 
-    int px = (int)((xv - xmin) / (xmax - xmin) * (c->width - 1));
-    int py = (int)((1 - (hv - ymin) / (ymax - ymin)) * (c->height - 1));
+*/
+
+#define PLT_STAMP_MAX_RADIUS 127
 
-    // bars drawn from the base (X axis) to the height
-    int base_y = (int)((1 - (0 - ymin) / (ymax - ymin)) * (c->height - 1));
-    int h = base_y - py; // height in pixels
+void plt_scatter_sized_ndarray(Canvas *c, ndarray *x, ndarray *y,
+                               ndarray *sizes, ndarray *values, Colormap *cm,
+                               double xmin, double xmax, double ymin,
+                               double ymax, double vmin, double vmax) {
+  if (!x || !y || !x->data || !y->data)
+    return;
+  int n = (x->shape[0] < y->shape[0]) ? x->shape[0] : y->shape[0];
+  if (sizes && sizes->shape[0] < n)
+    n = sizes->shape[0];
+  if (values && values->shape[0] < n)
+    n = values->shape[0];
+  if (n <= 0)
+    return;
+
+  const double *xd = (const double *)x->data;
+  const double *yd = (const double *)y->data;
+  const double *sd = sizes ? (const double *)sizes->data : NULL;
+  const double *vd = values ? (const double *)values->data : NULL;
 
-    if (h > 0) {
-      draw_rect(c, px - bar_width / 2, py, bar_width, h, col);
+  Colormap fallback;
+  if (!cm) {
+    colormap_fill(&fallback, g_viridis_stops, 8);
+    cm = &fallback;
+  }
+
+  // value range for the colormap
+  if (vd && vmin >= vmax) {
+    vmin = 1e308;
+    vmax = -1e308;
+    for (int i = 0; i < n; i++) {
+      vmin = vd[i] < vmin ? vd[i] : vmin;
+      vmax = vd[i] > vmax ? vd[i] : vmax;
     }
   }
-}
+  double vscale = (vmax > vmin) ? 1.0 / (vmax - vmin) : 0.0;
 
-void plt_bar_ndarray2(Canvas *c, ndarray *x, ndarray *y, Color col, double xmin,
-                      double xmax, double ymin, double ymax, int bar_width) {
-  int n = x->shape[0];
+  int *px = ft_malloc(sizeof(int) * n);
+  int *py = ft_malloc(sizeof(int) * n);
+  int *order = ft_malloc(sizeof(int) * n);
+  unsigned char *rad = ft_malloc(n);
+  unsigned char *cidx = ft_malloc(n);
+  int bucket[PLT_STAMP_MAX_RADIUS + 2] = {0};
+  if (!px || !py || !order || !rad || !cidx) {
+    ft_printf("Error: plt_scatter_sized_ndarray out of memory\n");
+    ft_free(px);
+    ft_free(py);
+    ft_free(order);
+    ft_free(rad);
+    ft_free(cidx);
+    return;
+  }
+
+  // 1. project, quantise and count per radius
   for (int i = 0; i < n; i++) {
-    double xv = ndarray_get1d(x, i);
-    double yv = ndarray_get1d(y, i);
+    double s = sd ? sd[i] : 3.0;
+    int r = (s > 0.0) ? (int)(s + 0.5) : 0; // NaN -> 0
+    if (r > PLT_STAMP_MAX_RADIUS)
+      r = PLT_STAMP_MAX_RADIUS;
+    px[i] = (int)((xd[i] - xmin) / (xmax - xmin) * (c->width - 1));
+    py[i] = (int)((1 - (yd[i] - ymin) / (ymax - ymin)) * (c->height - 1));
+    rad[i] = (unsigned char)r;
+    cidx[i] = (unsigned char)colormap_index(vd ? (vd[i] - vmin) * vscale
+                                               : 0.5);
+    // drop NaN coordinates and markers entirely off the canvas
+    if (xd[i] != xd[i] || yd[i] != yd[i] || px[i] + r < 0 || py[i] + r < 0 ||
+        px[i] - r >= c->width || py[i] - r >= c->height) {
+      rad[i] = PLT_STAMP_MAX_RADIUS + 1;
+      continue;
+    }
+    bucket[r + 1]++;
+  }
 
-    int px = (int)((xv - xmin) / (xmax - xmin) * (c->width - 1));
-    int py = (int)((1 - (yv - ymin) / (ymax - ymin)) * (c->height - 1));
-    int base = (int)((1 - (0 - ymin) / (ymax - ymin)) * (c->height - 1));
+  // 2. stable counting sort, largest radius first
+  int start[PLT_STAMP_MAX_RADIUS + 1];
+  int pos = 0;
+  for (int r = PLT_STAMP_MAX_RADIUS; r >= 0; r--) {
+    start[r] = pos;
+    pos += bucket[r + 1];
+  }
+  int total = pos;
+  int next[PLT_STAMP_MAX_RADIUS + 1];
+  ft_memcpy(next, start, sizeof(next));
+  for (int i = 0; i < n; i++)
+    if (rad[i] <= PLT_STAMP_MAX_RADIUS)
+      order[next[rad[i]]++] = i;
 
-    for (int xx = px - bar_width / 2; xx <= px + bar_width / 2; xx++) {
-      draw_line(c, xx, base, xx, py, col);
+  // 3. one stamp per radius, blitted per point
+  int hw[2 * PLT_STAMP_MAX_RADIUS + 1];
+  int top = clip_top(c), bottom = clip_bottom(c);
+  for (int k = 0; k < total;) {
+    int r = rad[order[k]];
+    int end = start[r] + bucket[r + 1];
+
+    for (int dy = -r; dy <= r; dy++) {
+      int w = 0;
+      while ((w + 1) * (w + 1) + dy * dy <= r * r)
+        w++;
+      hw[dy + r] = w;
+    }
+
+    for (; k < end; k++) {
+      int i = order[k];
+      Color col = cm->lut[cidx[i]];
+      damage_add(c, px[i] - r, py[i] - r, px[i] + r, py[i] + r);
+      int y0 = py[i] - r < top ? top - py[i] : -r;
+      int y1 = py[i] + r >= bottom ? bottom - 1 - py[i] : r;
+      for (int dy = y0; dy <= y1; dy++) {
+        int xa = px[i] - hw[dy + r];
+        int xb = px[i] + hw[dy + r];
+        if (xb < 0 || xa >= c->width)
+          continue;
+        fill_row(c, xa < 0 ? 0 : xa, xb >= c->width ? c->width - 1 : xb,
+                 py[i] + dy, col);
+      }
     }
   }
+
+  ft_free(px);
+  ft_free(py);
+  ft_free(order);
+  ft_free(rad);
+  ft_free(cidx);
 }
 
-/*
+// one bar of plt_bar_ndarray, centred on xv
+static void bar_draw(Canvas *c, double xv, double hv, int bar_width, Color col,
+                     double xmin, double xmax, double ymin, double ymax) {
+  int px = (int)((xv - xmin) / (xmax - xmin) * (c->width - 1));
+  int py = (int)((1 - (hv - ymin) / (ymax - ymin)) * (c->height - 1));
+
+  // bars drawn from the base (X axis) to the height
+  int base_y = (int)((1 - (0 - ymin) / (ymax - ymin)) * (c->height - 1));
+  int h = base_y - py; // height in pixels
+
+  if (h > 0) {
+    draw_rect(c, px - bar_width / 2, py, bar_width, h, col);
+  }
+}
+
+// Bar Plot
+void plt_bar_ndarray(Canvas *c, ndarray *x, ndarray *height, Color col,
+                     double xmin, double xmax, double ymin, double ymax) {
+  int n = x->shape[0]; // assuming x and height are the same size
+  int bar_width = (int)(c->width / n) * 0.8; // relative width of the bars
+
+  for (int i = 0; i < n; i++)
+    bar_draw(c, ndarray_get1d(x, i), ndarray_get1d(height, i), bar_width, col,
+             xmin, xmax, ymin, ymax);
+}
+
+void plt_bar_ndarray2(Canvas *c, ndarray *x, ndarray *y, Color col, double xmin,
+                      double xmax, double ymin, double ymax, int bar_width) {
+  int n = x->shape[0];
+  for (int i = 0; i < n; i++) {
+    double xv = ndarray_get1d(x, i);
+    double yv = ndarray_get1d(y, i);
+
+    int px = (int)((xv - xmin) / (xmax - xmin) * (c->width - 1));
+    int py = (int)((1 - (yv - ymin) / (ymax - ymin)) * (c->height - 1));
+    int base = (int)((1 - (0 - ymin) / (ymax - ymin)) * (c->height - 1));
+
+    for (int xx = px - bar_width / 2; xx <= px + bar_width / 2; xx++) {
+      draw_line(c, xx, base, xx, py, col);
+    }
+  }
+}
+
+/*
 
 px_start and px_end divide the canvas horizontally between bins.
 
@@ -421,112 +1326,544 @@ we used 0 → top and max_count → bottom.
 
 */
 
-void plt_hist(Canvas *c, ndarray *data, int bins, Color col, double xmin,
-              double xmax) {
-  int *counts = ft_malloc(bins);
-  int n = data->shape[0];
+/*
 
-  // Counting the values ​​in each bin
-  for (int i = 0; i < n; i++) {
-    double val = ((double *)data->data)[i];
-    if (val < xmin || val > xmax)
-      continue; // ignore out of range
-    int bin = (int)((val - xmin) / (xmax - xmin) * bins);
-    if (bin == bins)
-      bin = bins - 1; // edge case
-    counts[bin]++;
+Histogram engine.
+
+The bin of v is (v - xmin) * inv_w with inv_w = bins / (xmax - xmin), clamped
+to [0, bins - 1] with selects instead of branches (NaN lands in bin 0). Values
+outside [xmin, xmax] still get a bin but add 0 through an in-range mask, so
+the loop body has no branches and the bin arithmetic compiles to packed
+min/max/convert instructions; only the increment itself is scalar. Large
+inputs are split across threads, each counting into its own array, and the
+arrays are summed at the end.
+
+*/
+
+#define PLT_HIST_GRAIN (1L << 18)
+#define PLT_HIST_LOCAL_MAX (1L << 23) // longs of per-thread counts, all threads
+
+static void hist_count_block(const double *v, long n, int bins, double xmin,
+                             double xmax, double inv_w, long *counts) {
+  double last = (double)(bins - 1);
+
+  for (long i = 0; i < n; i++) {
+    double t = (v[i] - xmin) * inv_w;
+    t = t > 0.0 ? t : 0.0;
+    t = t < last ? t : last;
+    counts[(int)t] += (v[i] >= xmin) & (v[i] <= xmax);
   }
+}
 
-  // Determines maximum height for scale
-  int max_count = 0;
-  for (int i = 0; i < bins; i++)
-    if (counts[i] > max_count)
-      max_count = counts[i];
+typedef struct {
+  const double *data;
+  int bins;
+  double xmin, xmax, inv_w;
+  long *local; // nworkers * bins
+} t_hist_job;
 
-  if (max_count == 0)
-    max_count = 1; // avoid division by zero
+static void hist_task(void *arg, int tid, long start, long end) {
+  t_hist_job *job = arg;
+  hist_count_block(job->data + start, end - start, job->bins, job->xmin,
+                   job->xmax, job->inv_w, job->local + (long)tid * job->bins);
+}
+
+// adds the histogram of data[0..n) to counts (bins entries)
+static void hist_engine(const double *data, long n, int bins, double xmin,
+                        double xmax, long *counts) {
+  if (!data || n <= 0 || bins <= 0 || !(xmax >= xmin))
+    return;
+  double inv_w = bins / (xmax - xmin);
 
-  // Draw rectangles for each bin
+  // every worker needs enough values to pay for zeroing and merging its array
+  long grain = (4L * bins > PLT_HIST_GRAIN) ? 4L * bins : PLT_HIST_GRAIN;
+  int nw = parallel_workers(n, grain);
+  if (nw > 1 && (long)nw * bins > PLT_HIST_LOCAL_MAX)
+    nw = (int)(PLT_HIST_LOCAL_MAX / bins);
+  t_hist_job job = {data, bins, xmin, xmax, inv_w, NULL};
+  if (nw > 1)
+    job.local = ft_calloc((size_t)nw * bins, sizeof(long));
+  if (!job.local) {
+    hist_count_block(data, n, bins, xmin, xmax, inv_w, counts);
+    return;
+  }
+
+  parallel_for(n, nw, hist_task, &job);
+  for (int t = 0; t < nw; t++) {
+    const long *src = job.local + (long)t * bins;
+    for (int i = 0; i < bins; i++)
+      counts[i] += src[i];
+  }
+  ft_free(job.local);
+}
+
+/*
+
+Bins are reduced to pixel columns before anything is drawn. With fewer bins
+than columns each bin spans a run of whole columns (the same px_start/px_end
+split as before). With more bins than columns every bin lands in the column
+of its left edge, and the column keeps the largest count (PLT_REDUCE_MAX,
+peaks stay visible) or the sum (PLT_REDUCE_SUM, area is preserved). Heights
+are normalised to the largest column value and each column is filled once.
+
+*/
+
+static void hist_draw_counts(Canvas *c, const long *counts, int bins,
+                             Color col, int reduce) {
+  long *column = ft_calloc(c->width, sizeof(long));
+  if (!column)
+    return;
   for (int i = 0; i < bins; i++) {
     int px_start = (int)((double)i / bins * c->width);
     int px_end = (int)((double)(i + 1) / bins * c->width);
-    int py_top =
-        (int)((1.0 - ((double)counts[i] / max_count)) * (c->height - 1));
-    // draw column
+    if (px_end <= px_start)
+      px_end = px_start + 1;
+    if (px_end > c->width)
+      px_end = c->width;
     for (int x = px_start; x < px_end; x++) {
-      for (int y = py_top; y < c->height; y++) {
-        set_pixel(c, x, y, col);
-      }
+      if (reduce == PLT_REDUCE_SUM)
+        column[x] += counts[i];
+      else if (counts[i] > column[x])
+        column[x] = counts[i];
     }
   }
 
-  ft_free(counts);
+  // Determines maximum height for scale
+  long max_count = 0;
+  for (int x = 0; x < c->width; x++)
+    if (column[x] > max_count)
+      max_count = column[x];
+  if (max_count == 0)
+    max_count = 1; // avoid division by zero
+
+  for (int x = 0; x < c->width; x++) {
+    int py_top =
+        (int)((1.0 - ((double)column[x] / max_count)) * (c->height - 1));
+    draw_vspan(c, x, py_top, c->height - 1, col);
+  }
+  ft_free(column);
 }
 
-void plt_hist2(Canvas *c, ndarray *data, int bins, Color col, double xmin,
-               double xmax) {
-  int *counts = ft_calloc(bins, sizeof(int));
-  int n = data->shape[0];
+static int histogram_init(Histogram *h, int bins, double xmin, double xmax) {
+  h->bins = bins;
+  h->xmin = xmin;
+  h->xmax = xmax;
+  h->total = 0;
+  h->counts = bins > 0 ? ft_calloc(bins, sizeof(long)) : NULL;
+  if (!h->counts) {
+    ft_printf("Error: histogram with %d bins: out of memory\n", bins);
+    return (-1);
+  }
+  return (0);
+}
 
-  // Counting the values ​​in each bin
-  for (int i = 0; i < n; i++) {
-    double val = ((double *)data->data)[i];
-    if (val < xmin || val > xmax)
+static void histogram_add(Histogram *h, const double *data, long n) {
+  hist_engine(data, n, h->bins, h->xmin, h->xmax, h->counts);
+  h->total = 0;
+  for (int i = 0; i < h->bins; i++)
+    h->total += h->counts[i];
+}
+
+// min/max of the finite values plus a 5% margin, as plt_hist_full does
+static void histogram_auto_range(const double *v, long n, double *xmin,
+                                 double *xmax) {
+  double lo[2], hi[2];
+  long nans[2];
+  int axis = 0;
+  minmax_reduce(&v, &n, &axis, 1, lo, hi, nans);
+  if (lo[0] - lo[0] != 0 || hi[0] - hi[0] != 0) { // an infinity won: rescan
+    lo[0] = 1.0 / 0.0;
+    hi[0] = -1.0 / 0.0;
+    for (long i = 0; i < n; i++) {
+      if (v[i] - v[i] != 0) // inf or NaN
+        continue;
+      lo[0] = v[i] < lo[0] ? v[i] : lo[0];
+      hi[0] = v[i] > hi[0] ? v[i] : hi[0];
+    }
+  }
+  if (lo[0] > hi[0]) {
+    lo[0] = 0;
+    hi[0] = 1;
+  }
+  double dx = (hi[0] - lo[0]) * 0.05;
+  if (dx == 0)
+    dx = 1.0;
+  *xmin = lo[0] - dx;
+  *xmax = hi[0] + dx;
+}
+
+Histogram *plt_histogram_compute(ndarray *data, int bins, double xmin,
+                                 double xmax) {
+  if (!data || !data->data || bins <= 0) {
+    ft_printf("Error: plt_histogram_compute received NULL data or bins <= 0\n");
+    return (NULL);
+  }
+  const double *v = (const double *)data->data;
+  long n = data->shape[0];
+  if (xmin >= xmax)
+    histogram_auto_range(v, n, &xmin, &xmax);
+
+  Histogram *h = ft_malloc(sizeof(Histogram));
+  if (!h)
+    return (NULL);
+  if (histogram_init(h, bins, xmin, xmax) != 0) {
+    ft_free(h);
+    return (NULL);
+  }
+  histogram_add(h, v, n);
+  return (h);
+}
+
+void plt_histogram_update(Histogram *h, ndarray *new_data) {
+  if (!h || !new_data || !new_data->data)
+    return;
+  histogram_add(h, (const double *)new_data->data, new_data->shape[0]);
+}
+
+int plt_histogram_merge(Histogram *dst, const Histogram *src) {
+  if (!dst || !src)
+    return (-1);
+  if (dst->bins != src->bins || dst->xmin != src->xmin ||
+      dst->xmax != src->xmax) {
+    ft_printf("Error: plt_histogram_merge needs identical bins and range\n");
+    return (-1);
+  }
+  for (int i = 0; i < dst->bins; i++)
+    dst->counts[i] += src->counts[i];
+  dst->total += src->total;
+  return (0);
+}
+
+void plt_histogram_draw(Canvas *c, const Histogram *h, Color col) {
+  plt_histogram_draw_columns(c, h, col, PLT_REDUCE_MAX);
+}
+
+void plt_histogram_draw_columns(Canvas *c, const Histogram *h, Color col,
+                                int reduce) {
+  if (!h || !h->counts)
+    return;
+  hist_draw_counts(c, h->counts, h->bins, col, reduce);
+}
+
+void plt_histogram_destroy(Histogram *h) {
+  if (!h)
+    return;
+  ft_free(h->counts);
+  ft_free(h);
+}
+
+/*
+
+Streaming histograms.
+
+The range is unknown up front, so it starts as the extent of the first block
+and doubles whenever a value falls outside it: adjacent pairs of bins are
+merged into the half of the array on the side the range did not grow, and
+the other half starts empty. The bin count, and so the memory, never changes.
+Chunks are consumed in cache-sized blocks (min/max, grow, count) so every
+value is read from memory once.
+
+*/
+
+#define PLT_STREAM_BLOCK (1L << 16)
+
+// grows [xmin, xmax] by doubling until [lo, hi] fits, merging bin pairs; with
+// an odd bin count the old range's far-end bin pairs with the empty one past it
+static void histogram_stream_grow(Histogram *h, double lo, double hi) {
+  int n = h->bins;
+  long *cnt = h->counts;
+  while (lo < h->xmin || hi > h->xmax) {
+    double span = h->xmax - h->xmin;
+    if (!(span * 2 < 1e308))
+      return; // cannot grow further; outliers are dropped by the engine
+    if (hi > h->xmax) {
+      // new bin i holds old bins 2i and 2i + 1; the upper half empties
+      for (int i = 0; i < n; i++)
+        cnt[i] = (2 * i < n ? cnt[2 * i] : 0) +
+                 (2 * i + 1 < n ? cnt[2 * i + 1] : 0);
+      h->xmax = h->xmin + 2 * span;
+    } else {
+      // new bin j holds old bins 2j - n and 2j - n + 1; the lower half empties
+      for (int j = n - 1; j >= 0; j--)
+        cnt[j] = (2 * j - n >= 0 ? cnt[2 * j - n] : 0) +
+                 (2 * j - n + 1 >= 0 ? cnt[2 * j - n + 1] : 0);
+      h->xmin = h->xmax - 2 * span;
+    }
+  }
+}
+
+Histogram *plt_histogram_stream_create(int bins) {
+  if (bins < 2)
+    bins = 2;
+  bins += bins & 1; // even, so every merge pairs two real bins
+  Histogram *h = ft_malloc(sizeof(Histogram));
+  if (!h)
+    return (NULL);
+  if (histogram_init(h, bins, 0, 0) != 0) {
+    ft_free(h);
+    return (NULL);
+  }
+  return (h);
+}
+
+void plt_histogram_stream_push(Histogram *h, const double *chunk, long n) {
+  if (!h || !chunk || n <= 0)
+    return;
+  for (long base = 0; base < n; base += PLT_STREAM_BLOCK) {
+    long m = (n - base < PLT_STREAM_BLOCK) ? n - base : PLT_STREAM_BLOCK;
+    const double *v = chunk + base;
+
+    // extent of the finite values (v - v is NaN for NaN and +-inf)
+    double lo = 1e308, hi = -1e308;
+    for (long i = 0; i < m; i++) {
+      double f = v[i] - v[i];
+      lo = (f == 0.0 && v[i] < lo) ? v[i] : lo;
+      hi = (f == 0.0 && v[i] > hi) ? v[i] : hi;
+    }
+    if (lo > hi)
       continue;
-    int bin = (int)((val - xmin) / (xmax - xmin) * bins);
-    if (bin == bins)
-      bin = bins - 1;
-    counts[bin]++;
+
+    if (h->xmin >= h->xmax) {
+      // first values: start from their extent
+      h->xmin = lo;
+      h->xmax = hi > lo ? hi : lo + 1.0;
+    }
+    histogram_stream_grow(h, lo, hi);
+    hist_engine(v, m, h->bins, h->xmin, h->xmax, h->counts);
   }
+  h->total = 0;
+  for (int i = 0; i < h->bins; i++)
+    h->total += h->counts[i];
+}
 
-  // Determines maximum height for scale
-  int max_count = 0;
-  for (int i = 0; i < bins; i++)
-    if (counts[i] > max_count)
-      max_count = counts[i];
-  if (max_count == 0)
-    max_count = 1;
+int plt_histogram_stream_file(Histogram *h, const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    ft_printf("Error: plt_histogram_stream_file cannot open %s\n", path);
+    return (-1);
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return (-1);
+  }
+  long n = (long)(st.st_size / sizeof(double));
+  if (n == 0) {
+    close(fd);
+    return (0);
+  }
+  void *map = mmap(NULL, n * sizeof(double), PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    ft_printf("Error: plt_histogram_stream_file cannot map %s\n", path);
+    return (-1);
+  }
+  madvise(map, n * sizeof(double), MADV_SEQUENTIAL);
+  plt_histogram_stream_push(h, (const double *)map, n);
+  munmap(map, n * sizeof(double));
+  return (0);
+}
 
-  // Draw rectangles for each bin
-  for (int i = 0; i < bins; i++) {
-    int px_start = (int)((double)i / bins * c->width);
-    int px_end = (int)((double)(i + 1) / bins * c->width);
-    int py_top =
-        (int)((1.0 - ((double)counts[i] / max_count)) * (c->height - 1));
-    for (int x = px_start; x < px_end; x++) {
-      for (int y = py_top; y < c->height; y++) {
-        set_pixel(c, x, y, col);
-      }
+/*
+
+Integer histograms.
+
+Small-range integers need no float math: the bin is the value itself (or
+v - vmin). Incrementing one counter table back to back stalls when
+neighbouring values repeat, as they do in images, because each increment
+waits for the previous store to the same slot. The 8 and 16-bit paths
+therefore spread consecutive values over four 32-bit tables that are summed
+afterwards (flushed to the long counts every 2^30 values so they cannot
+overflow). Wider ints use v - vmin with a sentinel slot for values out of
+range. All three split large inputs across threads like the float engine.
+
+*/
+
+#define PLT_INT_FLUSH (1L << 30)
+
+typedef struct {
+  const void *data;
+  int kind; // 1: u8, 2: u16, 4: int
+  int vmin, nbins;
+  long *local; // nworkers * (nbins + 1)
+} t_int_hist;
+
+static void int_hist_u8(const unsigned char *p, long n, long *out) {
+  unsigned int t[4][256];
+  for (long base = 0; base < n; base += PLT_INT_FLUSH) {
+    long m = (n - base < PLT_INT_FLUSH) ? n - base : PLT_INT_FLUSH;
+    const unsigned char *q = p + base;
+    ft_memset(t, 0, sizeof(t));
+    long i = 0;
+    for (; i + 4 <= m; i += 4) {
+      t[0][q[i]]++;
+      t[1][q[i + 1]]++;
+      t[2][q[i + 2]]++;
+      t[3][q[i + 3]]++;
     }
+    for (; i < m; i++)
+      t[0][q[i]]++;
+    for (int k = 0; k < 256; k++)
+      out[k] += (long)t[0][k] + t[1][k] + t[2][k] + t[3][k];
   }
+}
 
-  ft_free(counts);
+static void int_hist_u16(const unsigned short *p, long n, long *out) {
+  unsigned int *t = ft_calloc(4 * 65536, sizeof(unsigned int));
+  if (!t) {
+    for (long i = 0; i < n; i++)
+      out[p[i]]++;
+    return;
+  }
+  for (long base = 0; base < n; base += PLT_INT_FLUSH) {
+    long m = (n - base < PLT_INT_FLUSH) ? n - base : PLT_INT_FLUSH;
+    const unsigned short *q = p + base;
+    long i = 0;
+    for (; i + 4 <= m; i += 4) {
+      t[q[i]]++;
+      t[65536 + q[i + 1]]++;
+      t[2 * 65536 + q[i + 2]]++;
+      t[3 * 65536 + q[i + 3]]++;
+    }
+    for (; i < m; i++)
+      t[q[i]]++;
+    for (int k = 0; k < 65536; k++) {
+      out[k] += (long)t[k] + t[65536 + k] + t[2 * 65536 + k] +
+                t[3 * 65536 + k];
+    }
+    ft_memset(t, 0, 4 * 65536 * sizeof(unsigned int));
+  }
+  ft_free(t);
+}
+
+// out has nbins + 1 slots, the last one collects out-of-range values
+static void int_hist_int(const int *p, long n, int vmin, int nbins,
+                         long *out) {
+  for (long i = 0; i < n; i++) {
+    unsigned int k = (unsigned int)p[i] - (unsigned int)vmin;
+    out[k < (unsigned int)nbins ? k : (unsigned int)nbins]++;
+  }
+}
+
+static void int_hist_task(void *arg, int tid, long start, long end) {
+  t_int_hist *job = arg;
+  long *out = job->local + (long)tid * (job->nbins + 1);
+  if (job->kind == 1)
+    int_hist_u8((const unsigned char *)job->data + start, end - start, out);
+  else if (job->kind == 2)
+    int_hist_u16((const unsigned short *)job->data + start, end - start, out);
+  else
+    int_hist_int((const int *)job->data + start, end - start, job->vmin,
+                 job->nbins, out);
+}
+
+static Histogram *int_hist_compute(const void *data, long n, int kind,
+                                   int vmin, int vmax) {
+  if (!data || n < 0 || vmax < vmin)
+    return (NULL);
+  long span = (long)vmax - vmin + 1;
+  if (span > (1L << 26)) {
+    ft_printf("Error: integer histogram range too wide (%ld)\n", span);
+    return (NULL);
+  }
+  int nbins = (int)span;
+  Histogram *h = ft_malloc(sizeof(Histogram));
+  if (!h)
+    return (NULL);
+  if (histogram_init(h, nbins, vmin - 0.5, vmax + 0.5) != 0) {
+    ft_free(h);
+    return (NULL);
+  }
+
+  long grain = (4L * nbins > PLT_HIST_GRAIN) ? 4L * nbins : PLT_HIST_GRAIN;
+  int nw = parallel_workers(n, grain);
+  if (nw > 1 && (long)nw * (nbins + 1) > PLT_HIST_LOCAL_MAX)
+    nw = (int)(PLT_HIST_LOCAL_MAX / (nbins + 1));
+  t_int_hist job = {data, kind, vmin, nbins, NULL};
+  job.local = ft_calloc((size_t)nw * (nbins + 1), sizeof(long));
+  if (!job.local) {
+    plt_histogram_destroy(h);
+    return (NULL);
+  }
+  parallel_for(n, nw, int_hist_task, &job);
+  for (int t = 0; t < nw; t++) {
+    const long *src = job.local + (long)t * (nbins + 1);
+    for (int i = 0; i < nbins; i++)
+      h->counts[i] += src[i];
+  }
+  ft_free(job.local);
+  for (int i = 0; i < nbins; i++)
+    h->total += h->counts[i];
+  return (h);
+}
+
+Histogram *plt_histogram_u8(const unsigned char *data, long n) {
+  return (int_hist_compute(data, n, 1, 0, 255));
+}
+
+Histogram *plt_histogram_u16(const unsigned short *data, long n) {
+  return (int_hist_compute(data, n, 2, 0, 65535));
+}
+
+Histogram *plt_histogram_int(const int *data, long n, int vmin, int vmax) {
+  return (int_hist_compute(data, n, 4, vmin, vmax));
+}
+
+// one bar per bin at its centre, through plt_bar_ndarray
+void plt_hist_categorical(Canvas *c, const Histogram *h, Color col) {
+  if (!h || !h->counts || h->bins <= 0)
+    return;
+  double w = (h->xmax - h->xmin) / h->bins;
+  double top = 0;
+  for (int i = 0; i < h->bins; i++)
+    top = (double)h->counts[i] > top ? (double)h->counts[i] : top;
+  // the bars of plt_bar_ndarray, without wrapping the bins in ndarrays
+  int bar_width = (int)(c->width / h->bins) * 0.8;
+  for (int i = 0; i < h->bins; i++)
+    bar_draw(c, h->xmin + (i + 0.5) * w, (double)h->counts[i], bar_width, col,
+             h->xmin, h->xmax, 0, top > 0 ? top * 1.05 : 1);
+}
+
+static void hist_render(Canvas *c, ndarray *data, int bins, Color col,
+                        double xmin, double xmax) {
+  Histogram h;
+  if (!data || !data->data || histogram_init(&h, bins, xmin, xmax) != 0)
+    return;
+  histogram_add(&h, (const double *)data->data, data->shape[0]);
+  plt_histogram_draw(c, &h, col);
+  ft_free(h.counts);
+}
+
+void plt_hist(Canvas *c, ndarray *data, int bins, Color col, double xmin,
+              double xmax) {
+  hist_render(c, data, bins, col, xmin, xmax);
+}
+
+void plt_hist2(Canvas *c, ndarray *data, int bins, Color col, double xmin,
+               double xmax) {
+  hist_render(c, data, bins, col, xmin, xmax);
 }
 
 void plt_hist_full(Canvas *c, ndarray *data, int bins, Color col,
                    const char *title, const char *xlabel, const char *ylabel) {
 
-  // auto scale
-  double xmin = ((double *)data->data)[0], xmax = xmin;
-  for (int i = 0; i < data->shape[0]; i++) {
-    double v = ((double *)data->data)[i];
-    if (v < xmin)
-      xmin = v;
-    if (v > xmax)
-      xmax = v;
-  }
-  double dx = (xmax - xmin) * 0.05;
-  xmin -= dx;
-  xmax += dx;
+  if (!data || !data->data || data->shape[0] <= 0)
+    return;
+
+  // auto scale (xmin >= xmax asks for the data range plus 5%)
+  Histogram *h = plt_histogram_compute(data, bins, 0, 0);
+  if (!h)
+    return;
 
   // ymin/ymax adjusted the plt_hist function
-  AxisLimits lim = {xmin, xmax, 0, 0};
+  AxisLimits lim = {h->xmin, h->xmax, 0, 0};
 
   // Draw axis
   plt_axes2(c, lim, (Color){0, 0, 0}, 5);
 
   // Draw histogram
-  plt_hist2(c, data, bins, col, xmin, xmax);
+  plt_histogram_draw(c, h, col);
+  plt_histogram_destroy(h);
 
   // Labels and title
   plt_title(c, title, (Color){0, 0, 0});
@@ -534,132 +1871,3163 @@ void plt_hist_full(Canvas *c, ndarray *data, int bins, Color col,
   plt_ylabel(c, ylabel, (Color){0, 0, 0});
 }
 
-void plt_plot_ndarray(Canvas *c, ndarray *x, ndarray *y, Color col, double xmin,
-                      double xmax, double ymin, double ymax) {
-  int n = x->shape[0];
-  if (n < 2)
-    return;
+/*
 
-  for (int i = 0; i < n - 1; i++) {
-    double xv1 = ndarray_get1d(x, i);
-    double yv1 = ndarray_get1d(y, i);
-    double xv2 = ndarray_get1d(x, i + 1);
-    double yv2 = ndarray_get1d(y, i + 1);
+2D histograms and hexbin.
 
-    // convert to pixels
-    int px1 = (int)((xv1 - xmin) / (xmax - xmin) * (c->width - 1));
-    int py1 = (int)((1 - (yv1 - ymin) / (ymax - ymin)) * (c->height - 1));
+Both count into a dense grid with the same multiply-by-inverse-width mapping
+as the 1D engine, on several threads with one grid each, summed at the end.
+Hexbin uses matplotlib's two offset rectangular lattices: a point belongs to
+the nearer of its two candidate centres (y distances weighted by 3), which
+tiles the plane with hexagons. Rendering walks the canvas once and colors
+every pixel by the count of the cell its centre falls in, through the
+colormap LUT, so each pixel is written at most once; empty cells stay blank.
 
-    int px2 = (int)((xv2 - xmin) / (xmax - xmin) * (c->width - 1));
-    int py2 = (int)((1 - (yv2 - ymin) / (ymax - ymin)) * (c->height - 1));
+*/
 
-    draw_line(c, px1, py1, px2, py2, col);
-  }
-}
+typedef struct {
+  const double *x, *y;
+  int hex;
+  int nx, ny; // hex: columns of the first lattice minus one, and rows
+  double xmin, xmax, ymin, ymax;
+  double inv_sx, inv_sy;
+  long ncells;
+  long *local;
+} t_bin2d;
 
-void plt_savefig(Canvas *c, const char *filename) {
-  stbi_write_png(filename, c->width, c->height, 3, c->pixels, c->width * 3);
+static inline long bin2d_rect(const t_bin2d *b, double xv, double yv) {
+  double tx = (xv - b->xmin) * b->inv_sx;
+  double ty = (yv - b->ymin) * b->inv_sy;
+  tx = tx > 0.0 ? tx : 0.0;
+  tx = tx < b->nx - 1 ? tx : b->nx - 1;
+  ty = ty > 0.0 ? ty : 0.0;
+  ty = ty < b->ny - 1 ? ty : b->ny - 1;
+  return ((long)(int)ty * b->nx + (int)tx);
 }
 
-AxisLimits plt_axis_auto(ndarray *x, ndarray *y) {
-  // Default axis limits (safe fallback)
-  AxisLimits lim = {0, 1, 0, 1};
+// cell of (xv, yv) in data space; lattice 1 first, then lattice 2
+static inline long bin2d_hex(const t_bin2d *b, double xv, double yv) {
+  double tx = (xv - b->xmin) * b->inv_sx;
+  double ty = (yv - b->ymin) * b->inv_sy;
+  int ix1 = (int)(tx + 0.5), iy1 = (int)(ty + 0.5);
+  int ix2 = (int)tx, iy2 = (int)ty;
+  double d1 = (tx - ix1) * (tx - ix1) + 3 * (ty - iy1) * (ty - iy1);
+  double d2 = (tx - ix2 - 0.5) * (tx - ix2 - 0.5) +
+              3 * (ty - iy2 - 0.5) * (ty - iy2 - 0.5);
+  if (d1 < d2)
+    return ((long)ix1 * (b->ny + 1) + iy1);
+  if (ix2 >= b->nx)
+    ix2 = b->nx - 1;
+  if (iy2 >= b->ny)
+    iy2 = b->ny - 1;
+  return ((long)(b->nx + 1) * (b->ny + 1) + (long)ix2 * b->ny + iy2);
+}
 
-  // 1. Validate pointers
-  if (!x || !y) {
-    ft_printf("Error: plt_axis_auto received NULL pointer (x or y)\n");
-    return (lim);
+static void bin2d_task(void *arg, int tid, long start, long end) {
+  t_bin2d *b = arg;
+  long *counts = b->local + (long)tid * b->ncells;
+  for (long i = start; i < end; i++) {
+    double xv = b->x[i], yv = b->y[i];
+    int in = (xv >= b->xmin) & (xv <= b->xmax) & (yv >= b->ymin) &
+             (yv <= b->ymax);
+    if (b->hex) {
+      if (in)
+        counts[bin2d_hex(b, xv, yv)]++;
+    } else
+      counts[bin2d_rect(b, xv, yv)] += in;
   }
+}
 
-  // 2. Validate dimensions (we only handle 1D arrays here)
-  if (x->ndim != 1 || y->ndim != 1) {
-    ft_printf("Error: plt_axis_auto supports only 1D arrays\n");
-    return (lim);
+// counts into a fresh grid (caller frees), NULL on failure
+static long *bin2d_count(t_bin2d *b, long n) {
+  long *grid = ft_calloc(b->ncells, sizeof(long));
+  if (!grid)
+    return (NULL);
+  long grain =
+      (4 * b->ncells > PLT_HIST_GRAIN) ? 4 * b->ncells : PLT_HIST_GRAIN;
+  int nw = parallel_workers(n, grain);
+  if (nw > 1 && nw * b->ncells > PLT_HIST_LOCAL_MAX)
+    nw = (int)(PLT_HIST_LOCAL_MAX / b->ncells);
+  b->local = nw > 1 ? ft_calloc(nw * b->ncells, sizeof(long)) : NULL;
+  if (!b->local) {
+    b->local = grid;
+    bin2d_task(b, 0, 0, n);
+    return (grid);
   }
+  parallel_for(n, nw, bin2d_task, b);
+  for (int t = 0; t < nw; t++) {
+    const long *src = b->local + (long)t * b->ncells;
+    for (long i = 0; i < b->ncells; i++)
+      grid[i] += src[i];
+  }
+  ft_free(b->local);
+  return (grid);
+}
 
-  // 3. Validate size
-  if (x->shape[0] <= 0 || y->shape[0] <= 0) {
-    ft_printf("Error: empty arrays passed to plt_axis_auto\n");
-    return (lim);
+static void bin2d_render(Canvas *c, t_bin2d *b, const long *grid,
+                         Colormap *cm) {
+  Colormap fallback;
+  if (!cm) {
+    colormap_fill(&fallback, g_viridis_stops, 8);
+    cm = &fallback;
   }
+  long max = 0;
+  for (long i = 0; i < b->ncells; i++)
+    max = grid[i] > max ? grid[i] : max;
+  if (max == 0)
+    return;
+  double inv_max = 1.0 / max;
+  damage_add(c, 0, 0, c->width - 1, c->height - 1);
+  double dx = (b->xmax - b->xmin) / (c->width > 1 ? c->width - 1 : 1);
+  double dy = (b->ymax - b->ymin) / (c->height > 1 ? c->height - 1 : 1);
 
-  // 4. Handle mismatch between x and y sizes
-  if (x->shape[0] != y->shape[0]) {
-    ft_printf(
-        "Warning: x and y sizes differ (%d vs %d). Using the smaller one.\n",
-        x->shape[0], y->shape[0]);
+  for (int py = clip_top(c); py < clip_bottom(c); py++) {
+    double yv = b->ymax - py * dy;
+    unsigned char *row = c->pixels + 3 * py * c->width;
+    for (int px = 0; px < c->width; px++) {
+      double xv = b->xmin + px * dx;
+      long k = b->hex ? bin2d_hex(b, xv, yv) : bin2d_rect(b, xv, yv);
+      if (grid[k] == 0)
+        continue;
+      Color col = cm->lut[colormap_index(grid[k] * inv_max)];
+      row[3 * px] = col.r;
+      row[3 * px + 1] = col.g;
+      row[3 * px + 2] = col.b;
+    }
   }
+}
 
-  int n = (x->shape[0] < y->shape[0]) ? x->shape[0] : y->shape[0];
+static int bin2d_setup(t_bin2d *b, ndarray *x, ndarray *y, double xmin,
+                       double xmax, double ymin, double ymax, long *n) {
+  if (!x || !y || !x->data || !y->data)
+    return (-1);
+  *n = (x->shape[0] < y->shape[0]) ? x->shape[0] : y->shape[0];
+  b->x = (const double *)x->data;
+  b->y = (const double *)y->data;
+  if (xmin >= xmax)
+    histogram_auto_range(b->x, *n, &xmin, &xmax);
+  if (ymin >= ymax)
+    histogram_auto_range(b->y, *n, &ymin, &ymax);
+  b->xmin = xmin;
+  b->xmax = xmax;
+  b->ymin = ymin;
+  b->ymax = ymax;
+  return (0);
+}
 
-  // 5. Initialize limits with the first element
-  lim.xmin = lim.xmax = ndarray_get1d(x, 0);
-  lim.ymin = lim.ymax = ndarray_get1d(y, 0);
+void plt_hist2d(Canvas *c, ndarray *x, ndarray *y, int nx, int ny,
+                Colormap *cm, double xmin, double xmax, double ymin,
+                double ymax) {
+  t_bin2d b;
+  long n;
+  if (nx <= 0 || ny <= 0 ||
+      bin2d_setup(&b, x, y, xmin, xmax, ymin, ymax, &n) != 0)
+    return;
+  b.hex = 0;
+  b.nx = nx;
+  b.ny = ny;
+  b.inv_sx = nx / (b.xmax - b.xmin);
+  b.inv_sy = ny / (b.ymax - b.ymin);
+  b.ncells = (long)nx * ny;
+  long *grid = bin2d_count(&b, n);
+  if (!grid) {
+    ft_printf("Error: plt_hist2d out of memory\n");
+    return;
+  }
+  bin2d_render(c, &b, grid, cm);
+  ft_free(grid);
+}
 
-  // 6. Iterate over the rest of the data to find min/max
-  for (int i = 1; i < n; i++) {
-    double xv = ndarray_get1d(x, i);
-    double yv = ndarray_get1d(y, i);
+void plt_hexbin(Canvas *c, ndarray *x, ndarray *y, int gridsize, Colormap *cm,
+                double xmin, double xmax, double ymin, double ymax) {
+  t_bin2d b;
+  long n;
+  if (gridsize <= 0 ||
+      bin2d_setup(&b, x, y, xmin, xmax, ymin, ymax, &n) != 0)
+    return;
+  b.hex = 1;
+  b.nx = gridsize;
+  b.ny = (int)(gridsize / sqrt(3.0));
+  if (b.ny < 1)
+    b.ny = 1;
+  b.inv_sx = b.nx / (b.xmax - b.xmin);
+  b.inv_sy = b.ny / (b.ymax - b.ymin);
+  b.ncells = (long)(b.nx + 1) * (b.ny + 1) + (long)b.nx * b.ny;
+  long *grid = bin2d_count(&b, n);
+  if (!grid) {
+    ft_printf("Error: plt_hexbin out of memory\n");
+    return;
+  }
+  bin2d_render(c, &b, grid, cm);
+  ft_free(grid);
+}
 
-    if (xv < lim.xmin)
-      lim.xmin = xv;
-    if (xv > lim.xmax)
-      lim.xmax = xv;
+/*
 
-    if (yv < lim.ymin)
-      lim.ymin = yv;
-    if (yv > lim.ymax)
-      lim.ymax = yv;
-  }
+Quantile sketches (merging t-digest).
 
-  // 7. Add 5% margin around the data (like matplotlib)
-  double xmargin = (lim.xmax - lim.xmin) * 0.05;
-  double ymargin = (lim.ymax - lim.ymin) * 0.05;
+Values are buffered and, when the buffer fills, sorted and merged with the
+existing centroids in one pass. Two neighbours are fused while the result
+stays within one unit of the k1 scale k(q) = d / (2 pi) * asin(2q - 1), which
+keeps centroids small near the tails and bounds their number by about d
+(the compression), so memory is fixed no matter how many values are added.
+Sketches merge by feeding one's centroids to the other as weighted points.
+Only finite values are added: an infinity would turn a merged centroid's
+mean into inf - inf = NaN and give every plot of the sketch an infinite
+range.
 
-  // Avoid degenerate axes (all values the same)
-  if (xmargin == 0)
-    xmargin = 1.0;
-  if (ymargin == 0)
-    ymargin = 1.0;
+*/
 
-  lim.xmin -= xmargin;
-  lim.xmax += xmargin;
-  lim.ymin -= ymargin;
-  lim.ymax += ymargin;
+#define PLT_SKETCH_GRAIN (1L << 17)
 
-  return (lim);
+static double sketch_k(double q, double d) {
+  return (d / (2 * M_PI) * asin(2 * q - 1));
 }
 
-AxisLimits plt_axis_auto_multi(ndarray **xs, ndarray **ys, int nplots) {
-  AxisLimits lim;
-  lim.xmin = lim.ymin = 1e308;  // big positive
-  lim.xmax = lim.ymax = -1e308; // big negative
+static double sketch_q(double k, double d) {
+  if (k >= d / 4)
+    return (1.0);
+  return ((sin(k * 2 * M_PI / d) + 1) / 2);
+}
 
-  for (int p = 0; p < nplots; p++) {
-    ndarray *x = xs[p];
-    ndarray *y = ys[p];
+typedef struct {
+  double mean, weight;
+} t_centroid;
+
+static int centroid_cmp(const void *a, const void *b) {
+  double x = ((const t_centroid *)a)->mean;
+  double y = ((const t_centroid *)b)->mean;
+  return ((x > y) - (x < y));
+}
+
+static void sketch_compress(QuantileSketch *s) {
+  if (s->nbuf == 0)
+    return;
+  t_centroid *all = (t_centroid *)s->scratch;
+  int n = 0;
+  for (int i = 0; i < s->ncent; i++)
+    all[n++] = (t_centroid){s->means[i], s->weights[i]};
+  for (int i = 0; i < s->nbuf; i++) {
+    all[n++] = (t_centroid){s->buf_means[i], s->buf_weights[i]};
+    s->total += s->buf_weights[i];
+  }
+  s->nbuf = 0;
+  qsort(all, n, sizeof(t_centroid), centroid_cmp);
+
+  double d = s->compression;
+  double w_so_far = 0;
+  double w_limit = s->total * sketch_q(sketch_k(0, d) + 1, d);
+  t_centroid cur = all[0];
+  int out = 0;
+  for (int i = 1; i < n; i++) {
+    if (w_so_far + cur.weight + all[i].weight <= w_limit ||
+        out == s->cap - 1) {
+      cur.weight += all[i].weight;
+      cur.mean += (all[i].mean - cur.mean) * all[i].weight / cur.weight;
+      continue;
+    }
+    w_so_far += cur.weight;
+    s->means[out] = cur.mean;
+    s->weights[out++] = cur.weight;
+    w_limit = s->total * sketch_q(sketch_k(w_so_far / s->total, d) + 1, d);
+    cur = all[i];
+  }
+  s->means[out] = cur.mean;
+  s->weights[out++] = cur.weight;
+  s->ncent = out;
+}
+
+static void sketch_push(QuantileSketch *s, double v, double w) {
+  if (s->nbuf == s->buf_cap)
+    sketch_compress(s);
+  s->buf_means[s->nbuf] = v;
+  s->buf_weights[s->nbuf++] = w;
+}
+
+QuantileSketch *plt_sketch_create(double compression) {
+  if (compression <= 0)
+    compression = 100;
+  if (compression < 20)
+    compression = 20;
+  QuantileSketch *s = ft_calloc(1, sizeof(QuantileSketch));
+  if (!s)
+    return (NULL);
+  s->compression = compression;
+  s->cap = (int)(2 * compression) + 8;
+  s->buf_cap = (int)(5 * compression);
+  s->means = ft_malloc(sizeof(double) * s->cap);
+  s->weights = ft_malloc(sizeof(double) * s->cap);
+  s->buf_means = ft_malloc(sizeof(double) * s->buf_cap);
+  s->buf_weights = ft_malloc(sizeof(double) * s->buf_cap);
+  s->scratch = ft_malloc(sizeof(t_centroid) * (s->cap + s->buf_cap));
+  s->min = 1e308;
+  s->max = -1e308;
+  if (!s->means || !s->weights || !s->buf_means || !s->buf_weights ||
+      !s->scratch) {
+    plt_sketch_destroy(s);
+    return (NULL);
+  }
+  return (s);
+}
+
+void plt_sketch_destroy(QuantileSketch *s) {
+  if (!s)
+    return;
+  ft_free(s->means);
+  ft_free(s->weights);
+  ft_free(s->buf_means);
+  ft_free(s->buf_weights);
+  ft_free(s->scratch);
+  ft_free(s);
+}
+
+static void sketch_add_serial(QuantileSketch *s, const double *v, long n) {
+  for (long i = 0; i < n; i++) {
+    if (v[i] - v[i] != 0)
+      continue; // NaN or +-inf
+    s->min = v[i] < s->min ? v[i] : s->min;
+    s->max = v[i] > s->max ? v[i] : s->max;
+    sketch_push(s, v[i], 1.0);
+  }
+}
+
+int plt_sketch_merge(QuantileSketch *dst, QuantileSketch *src) {
+  if (!dst || !src)
+    return (-1);
+  sketch_compress(src);
+  for (int i = 0; i < src->ncent; i++)
+    sketch_push(dst, src->means[i], src->weights[i]);
+  dst->min = src->min < dst->min ? src->min : dst->min;
+  dst->max = src->max > dst->max ? src->max : dst->max;
+  return (0);
+}
+
+typedef struct {
+  const double *data;
+  QuantileSketch **local;
+} t_sketch_job;
+
+static void sketch_task(void *arg, int tid, long start, long end) {
+  t_sketch_job *job = arg;
+  if (job->local[tid])
+    sketch_add_serial(job->local[tid], job->data + start, end - start);
+}
+
+void plt_sketch_add(QuantileSketch *s, const double *v, long n) {
+  if (!s || !v || n <= 0)
+    return;
+  int nw = parallel_workers(n, PLT_SKETCH_GRAIN);
+  if (nw == 1) {
+    sketch_add_serial(s, v, n);
+    return;
+  }
+  QuantileSketch *local[PLT_MAX_THREADS];
+  for (int t = 0; t < nw; t++)
+    local[t] = plt_sketch_create(s->compression);
+  for (int t = 0; t < nw; t++) {
+    if (!local[t]) { // fall back to one thread
+      for (int k = 0; k < nw; k++)
+        plt_sketch_destroy(local[k]);
+      sketch_add_serial(s, v, n);
+      return;
+    }
+  }
+  t_sketch_job job = {v, local};
+  parallel_for(n, nw, sketch_task, &job);
+  for (int t = 0; t < nw; t++) {
+    plt_sketch_merge(s, local[t]);
+    plt_sketch_destroy(local[t]);
+  }
+}
+
+void plt_sketch_add_ndarray(QuantileSketch *s, ndarray *data) {
+  if (!data || !data->data)
+    return;
+  plt_sketch_add(s, (const double *)data->data, data->shape[0]);
+}
+
+long plt_sketch_count(QuantileSketch *s) {
+  sketch_compress(s);
+  return ((long)s->total);
+}
+
+double plt_sketch_quantile(QuantileSketch *s, double q) {
+  sketch_compress(s);
+  if (s->ncent == 0)
+    return (0.0 / 0.0);
+  q = q > 0 ? q : 0;
+  q = q < 1 ? q : 1;
+  const double *m = s->means, *w = s->weights;
+  int n = s->ncent;
+  double t = q * s->total;
+
+  // tails interpolate towards the exact extremes
+  if (t < w[0] / 2)
+    return (s->min + (m[0] - s->min) * t / (w[0] / 2));
+  if (t > s->total - w[n - 1] / 2) {
+    double f = (t - (s->total - w[n - 1] / 2)) / (w[n - 1] / 2);
+    return (m[n - 1] + (s->max - m[n - 1]) * f);
+  }
+  double cum = w[0] / 2; // position of the first centroid's centre
+  for (int i = 0; i < n - 1; i++) {
+    double next = cum + (w[i] + w[i + 1]) / 2;
+    if (t <= next)
+      return (m[i] + (m[i + 1] - m[i]) * (t - cum) / (next - cum));
+    cum = next;
+  }
+  return (m[n - 1]);
+}
+
+double plt_sketch_cdf(QuantileSketch *s, double x) {
+  sketch_compress(s);
+  if (s->ncent == 0 || x < s->min)
+    return (0.0);
+  if (x >= s->max)
+    return (1.0);
+  const double *m = s->means, *w = s->weights;
+  int n = s->ncent;
+  if (x < m[0]) {
+    double span = m[0] - s->min;
+    return (span > 0 ? (x - s->min) / span * (w[0] / 2) / s->total : 0.0);
+  }
+  double cum = w[0] / 2;
+  for (int i = 0; i < n - 1; i++) {
+    if (x < m[i + 1]) {
+      double f = (x - m[i]) / (m[i + 1] - m[i]);
+      return ((cum + f * (w[i] + w[i + 1]) / 2) / s->total);
+    }
+    cum += (w[i] + w[i + 1]) / 2;
+  }
+  double span = s->max - m[n - 1];
+  double f = span > 0 ? (x - m[n - 1]) / span : 1.0;
+  return ((cum + f * w[n - 1] / 2) / s->total);
+}
+
+// shared y range of a set of sketches, 5% margin
+static void sketches_range(QuantileSketch **g, int n, double *ymin,
+                           double *ymax) {
+  if (*ymin < *ymax)
+    return;
+  double lo = 1e308, hi = -1e308;
+  for (int i = 0; i < n; i++) {
+    if (!g[i] || plt_sketch_count(g[i]) == 0)
+      continue;
+    lo = g[i]->min < lo ? g[i]->min : lo;
+    hi = g[i]->max > hi ? g[i]->max : hi;
+  }
+  if (lo > hi) {
+    lo = 0;
+    hi = 1;
+  }
+  double dy = (hi - lo) * 0.05;
+  if (dy == 0)
+    dy = 1.0;
+  *ymin = lo - dy;
+  *ymax = hi + dy;
+}
+
+static inline int value_to_py(Canvas *c, double v, double ymin, double ymax) {
+  return ((int)((1 - (v - ymin) / (ymax - ymin)) * (c->height - 1)));
+}
+
+/*
+
+Box plots: box from Q1 to Q3 with a doubled median line, whiskers to the
+furthest extreme within 1.5 IQR, and a short tick at min/max when they lie
+beyond the whiskers (the sketch cannot list individual outliers).
+Groups share the canvas width in equal slots, boxes take half a slot.
+
+*/
+
+void plt_boxplot(Canvas *c, QuantileSketch **groups, int ngroups, Color col,
+                 double ymin, double ymax) {
+  if (!groups || ngroups <= 0)
+    return;
+  sketches_range(groups, ngroups, &ymin, &ymax);
+  double slot = (double)c->width / ngroups;
+
+  for (int g = 0; g < ngroups; g++) {
+    QuantileSketch *s = groups[g];
+    if (!s || plt_sketch_count(s) == 0)
+      continue;
+    double q1 = plt_sketch_quantile(s, 0.25);
+    double med = plt_sketch_quantile(s, 0.5);
+    double q3 = plt_sketch_quantile(s, 0.75);
+    double iqr = q3 - q1;
+    double wlo = q1 - 1.5 * iqr > s->min ? q1 - 1.5 * iqr : s->min;
+    double whi = q3 + 1.5 * iqr < s->max ? q3 + 1.5 * iqr : s->max;
+
+    int cx = (int)((g + 0.5) * slot);
+    int half = (int)(slot / 4);
+    if (half < 1)
+      half = 1;
+    int y_q1 = value_to_py(c, q1, ymin, ymax);
+    int y_q3 = value_to_py(c, q3, ymin, ymax);
+    int y_med = value_to_py(c, med, ymin, ymax);
+    int y_lo = value_to_py(c, wlo, ymin, ymax);
+    int y_hi = value_to_py(c, whi, ymin, ymax);
+
+    // box
+    draw_span(c, cx - half, cx + half, y_q1, col);
+    draw_span(c, cx - half, cx + half, y_q3, col);
+    draw_vspan(c, cx - half, y_q3, y_q1, col);
+    draw_vspan(c, cx + half, y_q3, y_q1, col);
+    draw_span(c, cx - half, cx + half, y_med, col);
+    draw_span(c, cx - half, cx + half, y_med + 1, col);
+
+    // whiskers and caps
+    draw_vspan(c, cx, y_hi, y_q3, col);
+    draw_vspan(c, cx, y_q1, y_lo, col);
+    draw_span(c, cx - half / 2, cx + half / 2, y_hi, col);
+    draw_span(c, cx - half / 2, cx + half / 2, y_lo, col);
+
+    // extremes beyond the whiskers
+    if (s->max > whi)
+      draw_span(c, cx - 1, cx + 1, value_to_py(c, s->max, ymin, ymax), col);
+    if (s->min < wlo)
+      draw_span(c, cx - 1, cx + 1, value_to_py(c, s->min, ymin, ymax), col);
+  }
+}
+
+/*
+
+Violin plots: the density of each pixel row is the difference of the
+sketch CDF at the row's two edges, lightly smoothed ([1 4 6 4 1] / 16) and
+scaled so each violin's widest row fills 90% of its slot. Rows are filled
+with spans; a black bar marks Q1..Q3 and a short span the median.
+
+*/
+
+void plt_violin(Canvas *c, QuantileSketch **groups, int ngroups, Color col,
+                double ymin, double ymax) {
+  if (!groups || ngroups <= 0)
+    return;
+  sketches_range(groups, ngroups, &ymin, &ymax);
+  double slot = (double)c->width / ngroups;
+  int rows = c->height;
+  double *dens = ft_malloc(sizeof(double) * rows);
+  double *smooth = ft_malloc(sizeof(double) * rows);
+  if (!dens || !smooth) {
+    ft_free(dens);
+    ft_free(smooth);
+    return;
+  }
+  double row_h = (ymax - ymin) / (c->height - 1);
+
+  for (int g = 0; g < ngroups; g++) {
+    QuantileSketch *s = groups[g];
+    if (!s || plt_sketch_count(s) == 0)
+      continue;
+
+    // value at the centre of row y is ymax - y * row_h
+    double prev = plt_sketch_cdf(s, ymax + row_h / 2);
+    for (int y = 0; y < rows; y++) {
+      double cdf = plt_sketch_cdf(s, ymax - (y + 0.5) * row_h);
+      dens[y] = prev - cdf;
+      prev = cdf;
+    }
+    double peak = 0;
+    for (int y = 0; y < rows; y++) {
+      double acc = 6 * dens[y];
+      acc += 4 * ((y > 0 ? dens[y - 1] : 0) + (y + 1 < rows ? dens[y + 1] : 0));
+      acc += (y > 1 ? dens[y - 2] : 0) + (y + 2 < rows ? dens[y + 2] : 0);
+      smooth[y] = acc / 16;
+      peak = smooth[y] > peak ? smooth[y] : peak;
+    }
+    if (peak <= 0)
+      continue;
+
+    int cx = (int)((g + 0.5) * slot);
+    double scale = slot * 0.45 / peak;
+    int y_top = value_to_py(c, s->max, ymin, ymax);
+    int y_bot = value_to_py(c, s->min, ymin, ymax);
+    for (int y = y_top < 0 ? 0 : y_top; y <= y_bot && y < rows; y++) {
+      int hw = (int)(smooth[y] * scale + 0.5);
+      draw_span(c, cx - hw, cx + hw, y, col);
+    }
+
+    Color black = {0, 0, 0};
+    draw_vspan(c, cx, value_to_py(c, plt_sketch_quantile(s, 0.75), ymin, ymax),
+               value_to_py(c, plt_sketch_quantile(s, 0.25), ymin, ymax),
+               black);
+    int y_med = value_to_py(c, plt_sketch_quantile(s, 0.5), ymin, ymax);
+    draw_span(c, cx - 3, cx + 3, y_med, black);
+  }
+  ft_free(dens);
+  ft_free(smooth);
+}
+
+/*
+
+Pixel-space run compression for polylines.
+
+Consecutive vertices that land in the same pixel column form a run. All
+segments inside a run are vertical, so together they cover exactly the span
+from the lowest to the highest vertex of the run: one draw_vspan replaces
+them (repeated pixels are just runs of height 1). Only segments that change
+column go through Bresenham, starting at the run's last vertex. The set of
+pixels written is the same as drawing every segment.
+
+*/
+
+typedef struct {
+  Canvas *c;
+  Color col;
+  int run_x;        // column of the current run
+  int lo, hi;       // vertical extent of the run
+  int last_y;       // last vertex of the run, start of the next segment
+  int npts;
+  int drawn;        // at least one pixel already written
+} t_polyrun;
+
+static inline void polyrun_begin(t_polyrun *pr, Canvas *c, Color col) {
+  pr->c = c;
+  pr->col = col;
+  pr->run_x = pr->lo = pr->hi = pr->last_y = 0;
+  pr->npts = 0;
+  pr->drawn = 0;
+}
+
+static inline void polyrun_flush(t_polyrun *pr) {
+  if (pr->lo < pr->hi) {
+    draw_vspan(pr->c, pr->run_x, pr->lo, pr->hi, pr->col);
+    pr->drawn = 1;
+  }
+}
+
+static inline void polyrun_push(t_polyrun *pr, int px, int py) {
+  if (pr->npts++ > 0 && px == pr->run_x) {
+    if (py < pr->lo)
+      pr->lo = py;
+    if (py > pr->hi)
+      pr->hi = py;
+    pr->last_y = py;
+    return;
+  }
+  if (pr->npts > 1) {
+    polyrun_flush(pr);
+    draw_line(pr->c, pr->run_x, pr->last_y, px, py, pr->col);
+    pr->drawn = 1;
+  }
+  pr->run_x = px;
+  pr->lo = pr->hi = pr->last_y = py;
+}
+
+static inline void polyrun_end(t_polyrun *pr) {
+  if (pr->npts < 2)
+    return;
+  polyrun_flush(pr);
+  // every vertex fell on one pixel: draw_line(a, a) still plots it
+  if (!pr->drawn)
+    set_pixel(pr->c, pr->run_x, pr->last_y, pr->col);
+}
+
+void plt_plot_ndarray(Canvas *c, ndarray *x, ndarray *y, Color col, double xmin,
+                      double xmax, double ymin, double ymax) {
+  int n = x->shape[0];
+  if (n < 2)
+    return;
+
+  t_polyrun pr;
+  t_dl_poly rec;
+  polyrun_begin(&pr, c, col);
+  dl_poly_begin(&rec, c, PLT_DL_LINE, col, 0,
+                (AxisLimits){xmin, xmax, ymin, ymax});
+  for (int i = 0; i < n; i++) {
+    double xv = ndarray_get1d(x, i);
+    double yv = ndarray_get1d(y, i);
+
+    // convert to pixels
+    int px = (int)((xv - xmin) / (xmax - xmin) * (c->width - 1));
+    int py = (int)((1 - (yv - ymin) / (ymax - ymin)) * (c->height - 1));
+
+    polyrun_push(&pr, px, py);
+    dl_poly_push(&rec, xv, yv);
+  }
+  polyrun_end(&pr);
+  dl_poly_end(&rec);
+}
+
+/*
+
+Kernel density estimate.
+
+The data is binned once into a fine grid (four cells per pixel, at least
+1024, a power of two) with the histogram engine, then smoothed by a
+Gaussian in the frequency domain: one real FFT of the zero-padded grid,
+a multiply by the kernel's transfer function exp(-2 pi^2 s^2 f^2), and one
+inverse FFT. That is O(m log m) after binning whatever the sample count.
+The curve is sampled per pixel column, scaled so its peak reaches the top
+like plt_hist's tallest bar, and drawn through the polyline path.
+
+*/
+
+// iterative radix-2 FFT, n a power of two; inverse is unscaled
+static void fft_radix2(double *re, double *im, int n, int inverse) {
+  for (int i = 1, j = 0; i < n; i++) {
+    int bit = n >> 1;
+    for (; j & bit; bit >>= 1)
+      j ^= bit;
+    j ^= bit;
+    if (i < j) {
+      double t = re[i];
+      re[i] = re[j];
+      re[j] = t;
+      t = im[i];
+      im[i] = im[j];
+      im[j] = t;
+    }
+  }
+  for (int len = 2; len <= n; len <<= 1) {
+    double ang = 2 * M_PI / len * (inverse ? 1 : -1);
+    double wr = cos(ang), wi = sin(ang);
+    for (int i = 0; i < n; i += len) {
+      double cr = 1, ci = 0;
+      for (int j = 0; j < len / 2; j++) {
+        int a = i + j, b = i + j + len / 2;
+        double vr = re[b] * cr - im[b] * ci;
+        double vi = re[b] * ci + im[b] * cr;
+        re[b] = re[a] - vr;
+        im[b] = im[a] - vi;
+        re[a] += vr;
+        im[a] += vi;
+        double t = cr * wr - ci * wi;
+        ci = cr * wi + ci * wr;
+        cr = t;
+      }
+    }
+  }
+}
+
+// fills re[0..m) with the smoothed density; returns its peak (0: no data)
+static double kde_grid(const double *v, long n, int m, double xmin,
+                       double xmax, double bandwidth, long *counts, double *re,
+                       double *im) {
+  int len = 2 * m; // zero padding keeps the circular convolution from wrapping
+  hist_engine(v, n, m, xmin, xmax, counts);
+  double step = (xmax - xmin) / m;
+
+  // Silverman's rule from the binned data when no bandwidth is given
+  double total = 0, mean = 0, var = 0;
+  for (int i = 0; i < m; i++) {
+    re[i] = (double)counts[i];
+    total += re[i];
+    mean += re[i] * (i + 0.5);
+  }
+  if (total == 0)
+    return (0);
+  mean /= total;
+  for (int i = 0; i < m; i++)
+    var += re[i] * (i + 0.5 - mean) * (i + 0.5 - mean);
+  if (bandwidth <= 0) {
+    double sd = sqrt(var / total) * step;
+    bandwidth = 1.06 * sd * pow(total, -0.2);
+    if (bandwidth <= 0)
+      bandwidth = step;
+  }
+
+  fft_radix2(re, im, len, 0);
+  double sigma = bandwidth / step; // in grid cells
+  for (int k = 0; k < len; k++) {
+    double f = (double)(k < len - k ? k : len - k) / len;
+    double g = exp(-2 * M_PI * M_PI * sigma * sigma * f * f);
+    re[k] *= g;
+    im[k] *= g;
+  }
+  fft_radix2(re, im, len, 1);
+
+  double peak = 0;
+  for (int i = 0; i < m; i++)
+    peak = re[i] > peak ? re[i] : peak;
+  return (peak);
+}
+
+void plt_kde(Canvas *c, ndarray *data, double bandwidth, Color col,
+             double xmin, double xmax) {
+  if (!data || !data->data || data->shape[0] <= 0 || c->width < 2)
+    return;
+  const double *v = (const double *)data->data;
+  long n = data->shape[0];
+  if (xmin >= xmax)
+    histogram_auto_range(v, n, &xmin, &xmax);
+
+  int m = 1024;
+  while (m < 4 * c->width)
+    m <<= 1;
+  long *counts = ft_calloc(m, sizeof(long));
+  double *re = ft_calloc(2 * m, sizeof(double));
+  double *im = ft_calloc(2 * m, sizeof(double));
+  double peak = 0;
+  if (counts && re && im)
+    peak = kde_grid(v, n, m, xmin, xmax, bandwidth, counts, re, im);
+  else
+    ft_printf("Error: plt_kde out of memory\n");
+
+  // sample per pixel column (grid values sit at cell centres)
+  if (peak > 0) {
+    t_polyrun pr;
+    polyrun_begin(&pr, c, col);
+    for (int px = 0; px < c->width; px++) {
+      double g = (double)px / (c->width - 1) * m - 0.5;
+      int i = g < 0 ? 0 : (int)g;
+      if (i > m - 2)
+        i = m - 2;
+      double f = g - i;
+      f = f < 0 ? 0 : (f > 1 ? 1 : f);
+      double d = re[i] + (re[i + 1] - re[i]) * f;
+      polyrun_push(&pr, px, (int)((1.0 - d / peak) * (c->height - 1)));
+    }
+    polyrun_end(&pr);
+  }
+  ft_free(counts);
+  ft_free(re);
+  ft_free(im);
+}
+
+/*
+
+PNG encoder.
+
+plt_savefig_opts writes the PNG itself instead of going through
+stbi_write_png, so the compression level, row filter and deflate backend
+are per call (stb keeps them in globals) and several threads can encode at
+once. Rows are filtered with one fixed filter, or with the usual minimum
+sum of absolute differences heuristic that tries all five. The filtered
+image is compressed by a backend with the STBIW_ZLIB_COMPRESS signature:
+
+  level 0      stored blocks, no compression
+  level 1-3    plt_deflate_fast, a greedy LZ77 with fixed Huffman codes
+  level 4-9    plt_deflate_stb, stb's compressor at that quality
+
+Building with FT_MATPLOTLIB_USE_ZLIB routes stb's compressor, and the low
+levels, to the system zlib. Buffers returned by a backend are released with
+STBIW_FREE.
+
+*/
+
+static void put_be32(unsigned char *p, unsigned int v) {
+  p[0] = (unsigned char)(v >> 24);
+  p[1] = (unsigned char)(v >> 16);
+  p[2] = (unsigned char)(v >> 8);
+  p[3] = (unsigned char)v;
+}
+
+static unsigned int g_crc_table[256];
+static unsigned short g_len_code[259];   // match length -> symbol - 257
+static unsigned char g_dist_code[512];   // see dist_code()
+static unsigned short g_lit_rev[288];    // fixed Huffman codes, bit reversed
+static unsigned char g_lit_bits[288];
+static pthread_once_t g_png_tables_once = PTHREAD_ONCE_INIT;
+
+static const unsigned short g_len_base[29] = {
+    3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+    31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const unsigned char g_len_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                              1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                              4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const unsigned short g_dist_base[30] = {
+    1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+    33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+    1025, 1537, 2049, 3073, 4097, 6145,  8193,  12289, 16385, 24577};
+static const unsigned char g_dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6,
+    6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+static unsigned int bit_reverse(unsigned int v, int n) {
+  unsigned int r = 0;
+  for (int i = 0; i < n; i++, v >>= 1)
+    r = (r << 1) | (v & 1);
+  return (r);
+}
+
+static void png_tables_init(void) {
+  for (unsigned int n = 0; n < 256; n++) {
+    unsigned int c = n;
+    for (int k = 0; k < 8; k++)
+      c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+    g_crc_table[n] = c;
+  }
+  for (int s = 0; s < 288; s++) {
+    unsigned int code;
+    int bits;
+    if (s < 144)
+      code = 0x30 + s, bits = 8;
+    else if (s < 256)
+      code = 0x190 + s - 144, bits = 9;
+    else if (s < 280)
+      code = s - 256, bits = 7;
+    else
+      code = 0xC0 + s - 280, bits = 8;
+    g_lit_rev[s] = (unsigned short)bit_reverse(code, bits);
+    g_lit_bits[s] = (unsigned char)bits;
+  }
+  for (int c = 0; c < 29; c++) {
+    int end = c == 28 ? 259 : g_len_base[c + 1];
+    for (int l = g_len_base[c]; l < end; l++)
+      g_len_code[l] = (unsigned short)c;
+  }
+  g_len_code[258] = 28;
+  // distances up to 256 directly, larger ones by (d - 1) >> 7
+  for (int c = 0; c < 30; c++) {
+    int end = c == 29 ? 32769 : g_dist_base[c + 1];
+    for (int d = g_dist_base[c]; d < end; d++) {
+      if (d <= 256)
+        g_dist_code[d - 1] = (unsigned char)c;
+      else
+        g_dist_code[256 + ((d - 1) >> 7)] = (unsigned char)c;
+    }
+  }
+}
+
+static inline int dist_code(int d) {
+  return (d <= 256 ? g_dist_code[d - 1] : g_dist_code[256 + ((d - 1) >> 7)]);
+}
+
+static unsigned int crc_update(unsigned int crc, const unsigned char *p,
+                                 size_t n) {
+  crc = ~crc;
+  for (size_t i = 0; i < n; i++)
+    crc = g_crc_table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+  return (~crc);
+}
+
+static unsigned int adler_update(unsigned int adler, const unsigned char *p,
+                                   size_t n) {
+  unsigned int a = adler & 0xFFFF, b = adler >> 16;
+  while (n > 0) {
+    size_t k = n < 5552 ? n : 5552; // largest block without overflow
+    n -= k;
+    while (k--) {
+      a += *p++;
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+  }
+  return ((b << 16) | a);
+}
+
+// LSB-first bit writer on a growable byte buffer
+typedef struct {
+  t_bytes out;
+  unsigned long long bits;
+  int nbits;
+  int failed;
+} t_bitout;
+
+static inline void bits_put(t_bitout *bo, unsigned int v, int n) {
+  bo->bits |= (unsigned long long)v << bo->nbits;
+  bo->nbits += n;
+  if (bo->nbits >= 32) {
+    if (bytes_reserve(&bo->out, 4) < 0) {
+      bo->failed = 1;
+      bo->nbits -= 32;
+      bo->bits >>= 32;
+      return;
+    }
+    for (int i = 0; i < 4; i++)
+      bo->out.data[bo->out.len++] = (unsigned char)(bo->bits >> (8 * i));
+    bo->bits >>= 32;
+    bo->nbits -= 32;
+  }
+}
+
+static void bits_align(t_bitout *bo) {
+  while (bo->nbits > 0) {
+    if (bytes_reserve(&bo->out, 1) < 0) {
+      bo->failed = 1;
+      return;
+    }
+    bo->out.data[bo->out.len++] = (unsigned char)bo->bits;
+    bo->bits >>= 8;
+    bo->nbits -= 8;
+  }
+  bo->bits = 0;
+  bo->nbits = 0;
+}
+
+static void deflate_stored(t_bitout *bo, const unsigned char *p, size_t n,
+                           int final) {
+  do {
+    size_t k = n < 65535 ? n : 65535;
+    n -= k;
+    bits_put(bo, final && n == 0, 1);
+    bits_put(bo, 0, 2);
+    bits_align(bo);
+    unsigned char hdr[4] = {(unsigned char)k, (unsigned char)(k >> 8),
+                            (unsigned char)~k, (unsigned char)(~k >> 8)};
+    if (bytes_put(&bo->out, hdr, 4) < 0 || bytes_put(&bo->out, p, k) < 0)
+      bo->failed = 1;
+    p += k;
+  } while (n > 0);
+}
+
+#define PLT_DEFLATE_HASH_BITS 15
+#define PLT_DEFLATE_WINDOW 32768
+
+static inline unsigned int deflate_hash(const unsigned char *p) {
+  unsigned int v = p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned)p[3] << 24);
+  return ((v * 2654435761u) >> (32 - PLT_DEFLATE_HASH_BITS));
+}
+
+static inline void deflate_literal(t_bitout *bo, int s) {
+  bits_put(bo, g_lit_rev[s], g_lit_bits[s]);
+}
+
+static inline void deflate_match(t_bitout *bo, int len, int dist) {
+  int lc = g_len_code[len];
+  deflate_literal(bo, 257 + lc);
+  if (g_len_extra[lc])
+    bits_put(bo, len - g_len_base[lc], g_len_extra[lc]);
+  int dc = dist_code(dist);
+  bits_put(bo, bit_reverse(dc, 5), 5);
+  if (g_dist_extra[dc])
+    bits_put(bo, dist - g_dist_base[dc], g_dist_extra[dc]);
+}
+
+/*
+
+One fixed-Huffman block over p[0, n), matches never reach before p. level
+sets how many hash chain candidates are tried (1 at level 1, 4 at 2, 16 at
+3 and up). head/prev are scratch of 1 << PLT_DEFLATE_HASH_BITS and
+PLT_DEFLATE_WINDOW ints.
+
+*/
+
+static void deflate_block(t_bitout *bo, const unsigned char *p, size_t n,
+                          int level, int final, int *head, int *prev) {
+  int depth = level <= 1 ? 1 : (level == 2 ? 4 : 16);
+  ft_memset(head, 0, sizeof(int) << PLT_DEFLATE_HASH_BITS);
+  bits_put(bo, final, 1);
+  bits_put(bo, 1, 2);
+  size_t i = 0;
+  while (i + 4 <= n) {
+    unsigned int h = deflate_hash(p + i);
+    long cand = (long)head[h] - 1;
+    head[h] = (int)i + 1;
+    if (depth > 1)
+      prev[i & (PLT_DEFLATE_WINDOW - 1)] = (int)cand + 1;
+    size_t best = 0, best_dist = 0;
+    size_t limit = n - i < 258 ? n - i : 258;
+    for (int d = 0; d < depth && cand >= 0 &&
+                    i - cand <= PLT_DEFLATE_WINDOW;
+         d++) {
+      const unsigned char *a = p + cand, *b = p + i;
+      if (a[best] == b[best]) {
+        size_t l = 0;
+        while (l < limit && a[l] == b[l])
+          l++;
+        if (l > best) {
+          best = l;
+          best_dist = i - cand;
+          if (l == limit)
+            break;
+        }
+      }
+      cand = (long)prev[cand & (PLT_DEFLATE_WINDOW - 1)] - 1;
+    }
+    if (best < 4) {
+      deflate_literal(bo, p[i++]);
+      continue;
+    }
+    deflate_match(bo, (int)best, (int)best_dist);
+    size_t end = i + best;
+    // level 1 skips the positions inside a match, the others index them
+    for (i++; depth > 1 && i < end && i + 4 <= n; i++) {
+      unsigned int hh = deflate_hash(p + i);
+      prev[i & (PLT_DEFLATE_WINDOW - 1)] = head[hh];
+      head[hh] = (int)i + 1;
+    }
+    i = end;
+  }
+  while (i < n)
+    deflate_literal(bo, p[i++]);
+  deflate_literal(bo, 256);
+}
+
+// raw deflate of p[0, n); final = 0 ends with a sync flush (byte aligned)
+static void deflate_raw(t_bitout *bo, const unsigned char *p, size_t n,
+                        int level, int final, int *head, int *prev) {
+  if (level <= 0)
+    deflate_stored(bo, p, n, final);
+  else
+    deflate_block(bo, p, n, level, final, head, prev);
+  if (!final)
+    deflate_stored(bo, p, 0, 0); // empty stored block: 00 00 ff ff
+  bits_align(bo);
+}
+
+static unsigned char *zlib_wrap(unsigned char *data, int len, int *out_len,
+                                int level) {
+  pthread_once(&g_png_tables_once, png_tables_init);
+  int *head = ft_malloc(sizeof(int) << PLT_DEFLATE_HASH_BITS);
+  int *prev = ft_malloc(sizeof(int) * PLT_DEFLATE_WINDOW);
+  t_bitout bo = {{NULL, 0, 0}, 0, 0, 0};
+  unsigned char hdr[2] = {0x78, 0x01};
+  if (!head || !prev || bytes_put(&bo.out, hdr, 2) < 0) {
+    ft_free(head);
+    ft_free(prev);
+    STBIW_FREE(bo.out.data);
+    return (NULL);
+  }
+  deflate_raw(&bo, data, (size_t)len, level, 1, head, prev);
+  ft_free(head);
+  ft_free(prev);
+  unsigned char tail[4];
+  put_be32(tail, adler_update(1, data, (size_t)len));
+  if (bo.failed || bytes_put(&bo.out, tail, 4) < 0) {
+    STBIW_FREE(bo.out.data);
+    return (NULL);
+  }
+  *out_len = (int)bo.out.len;
+  return (bo.out.data);
+}
+
+unsigned char *plt_deflate_fast(unsigned char *data, int len, int *out_len,
+                                int level) {
+  if (level < 1)
+    level = 1;
+  return (zlib_wrap(data, len, out_len, level > 3 ? 3 : level));
+}
+
+unsigned char *plt_deflate_stb(unsigned char *data, int len, int *out_len,
+                               int level) {
+  return (stbi_zlib_compress(data, len, out_len, level));
+}
+
+#ifdef FT_MATPLOTLIB_USE_ZLIB
+unsigned char *plt_zlib_compress(unsigned char *data, int len, int *out_len,
+                                 int level) {
+  uLongf cap = compressBound((uLong)len);
+  unsigned char *out = STBIW_MALLOC(cap);
+  if (!out)
+    return (NULL);
+  if (compress2(out, &cap, data, (uLong)len, level > 9 ? 9 : level) != Z_OK) {
+    STBIW_FREE(out);
+    return (NULL);
+  }
+  *out_len = (int)cap;
+  return (out);
+}
+#endif
+
+static DeflateFn deflate_backend(const SaveOptions *o) {
+  if (o->deflate)
+    return (o->deflate);
+#ifdef FT_MATPLOTLIB_USE_ZLIB
+  if (o->level > 0)
+    return (plt_zlib_compress);
+#endif
+  if (o->level <= 3)
+    return (plt_deflate_fast);
+  return (plt_deflate_stb);
+}
+
+static inline int paeth(int a, int b, int c) {
+  int p = a + b - c;
+  int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+  if (pa <= pb && pa <= pc)
+    return (a);
+  return (pb <= pc ? b : c);
+}
+
+// filters one row into out (without the filter byte); prev is NULL on row 0
+static void png_filter_row(unsigned char *out, const unsigned char *row,
+                           const unsigned char *prev, int n, int bpp,
+                           int type) {
+  if (!prev && (type == PLT_FILTER_UP || type == PLT_FILTER_PAETH))
+    type = type == PLT_FILTER_UP ? PLT_FILTER_NONE : PLT_FILTER_SUB;
+  int i = 0;
+  switch (type) {
+  case PLT_FILTER_NONE:
+    ft_memcpy(out, row, n);
+    break;
+  case PLT_FILTER_SUB:
+    for (; i < bpp && i < n; i++)
+      out[i] = row[i];
+    for (; i < n; i++)
+      out[i] = (unsigned char)(row[i] - row[i - bpp]);
+    break;
+  case PLT_FILTER_UP:
+    for (; i < n; i++)
+      out[i] = (unsigned char)(row[i] - prev[i]);
+    break;
+  case PLT_FILTER_AVG:
+    for (; i < bpp && i < n; i++)
+      out[i] = (unsigned char)(row[i] - ((prev ? prev[i] : 0) >> 1));
+    for (; i < n; i++)
+      out[i] = (unsigned char)(row[i] -
+                               ((row[i - bpp] + (prev ? prev[i] : 0)) >> 1));
+    break;
+  default: // Paeth, prev != NULL
+    for (; i < bpp && i < n; i++)
+      out[i] = (unsigned char)(row[i] - prev[i]);
+    for (; i < n; i++)
+      out[i] = (unsigned char)(row[i] -
+                               paeth(row[i - bpp], prev[i], prev[i - bpp]));
+  }
+}
+
+static long png_filter_cost(const unsigned char *p, int n) {
+  long s = 0;
+  for (int i = 0; i < n; i++)
+    s += abs((signed char)p[i]);
+  return (s);
+}
+
+/*
+
+Writes rows [y0, y1) as filtered scanlines (filter byte + n bytes each)
+into out. Rows are pitch bytes apart starting at pixels. trial is scratch
+of n bytes, used by the heuristic.
+
+*/
+
+static void png_filter_rows(unsigned char *out, const unsigned char *pixels,
+                            int y0, int y1, int n, int pitch, int bpp,
+                            int filter, unsigned char *trial) {
+  for (int y = y0; y < y1; y++) {
+    const unsigned char *row = pixels + (size_t)y * pitch;
+    const unsigned char *prev = y > 0 ? row - pitch : NULL;
+    unsigned char *dst = out + (size_t)(y - y0) * (n + 1);
+    int type = filter;
+    if (filter == PLT_FILTER_HEURISTIC) {
+      long best = -1;
+      for (int t = PLT_FILTER_NONE; t <= PLT_FILTER_PAETH; t++) {
+        png_filter_row(trial, row, prev, n, bpp, t);
+        long cost = png_filter_cost(trial, n);
+        if (best < 0 || cost < best) {
+          best = cost;
+          type = t;
+          ft_memcpy(dst + 1, trial, n);
+        }
+      }
+    } else {
+      png_filter_row(dst + 1, row, prev, n, bpp, type);
+    }
+    dst[0] = (unsigned char)type;
+  }
+}
+
+/*
+
+Encoder output and scratch.
+
+Encoded bytes go through a sink that either appends to a growable buffer or
+hands every piece to a stbi_write_func callback. Everything the encoder
+needs besides that (filtered rows, compressed bands, match tables) lives
+in per-band scratch hung off an EncodeBuffer and is only ever grown, so
+encoding again into the same EncodeBuffer does not allocate once the
+buffers have reached the image size.
+
+*/
+
+typedef struct {
+  t_bytes *buf;          // append here, or
+  stbi_write_func *func; // pass each piece to func
+  void *ctx;
+  size_t len;
+  int failed;
+} t_sink;
+
+static void sink_put(t_sink *s, const void *p, size_t n) {
+  if (s->failed || n == 0)
+    return;
+  if (s->func)
+    s->func(s->ctx, (void *)p, (int)n);
+  else if (bytes_put(s->buf, p, n) < 0)
+    s->failed = 1;
+  s->len += n;
+}
+
+static void png_chunk(t_sink *s, const char *type, const unsigned char *data,
+                      size_t n) {
+  unsigned char hdr[8], crc[4];
+  put_be32(hdr, (unsigned int)n);
+  ft_memcpy(hdr + 4, type, 4);
+  unsigned int c = crc_update(0, hdr + 4, 4);
+  put_be32(crc, crc_update(c, data, n));
+  sink_put(s, hdr, 8);
+  sink_put(s, data, n);
+  sink_put(s, crc, 4);
+}
+
+static void png_header(t_sink *s, int w, int h, int depth, int color_type) {
+  static const unsigned char sig[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+  unsigned char ihdr[13];
+  put_be32(ihdr, (unsigned int)w);
+  put_be32(ihdr + 4, (unsigned int)h);
+  ihdr[8] = (unsigned char)depth;
+  ihdr[9] = (unsigned char)color_type;
+  ihdr[10] = ihdr[11] = ihdr[12] = 0;
+  sink_put(s, sig, 8);
+  png_chunk(s, "IHDR", ihdr, 13);
+}
+
+typedef struct {
+  t_bytes raw;   // filtered rows
+  t_bytes trial; // one row, for the filter heuristic
+  t_bitout z;    // compressed band, as a complete IDAT chunk
+  int *head, *prev;
+  unsigned int adler;
+  size_t raw_len;
+} t_png_band;
+
+// bands kept by incremental encodes, see png_encode_cached
+typedef struct {
+  int width, height, stride, depth, color_type, level, filter;
+  int nbands, valid;
+  unsigned long long *hash; // rows of the band and the row above it
+  unsigned int *adler;
+  size_t *raw_len;
+  t_bytes *chunk; // the band's IDAT chunk
+  int *dirty;
+} t_png_cache;
+
+typedef struct {
+  t_png_band band[PLT_MAX_THREADS];
+  t_bytes index; // palette indices
+  t_png_cache cache;
+} t_png_scratch;
+
+static void png_cache_free(t_png_cache *pc) {
+  for (int k = 0; pc->chunk && k < pc->nbands; k++)
+    STBIW_FREE(pc->chunk[k].data);
+  ft_free(pc->hash);
+  ft_free(pc->adler);
+  ft_free(pc->raw_len);
+  ft_free(pc->chunk);
+  ft_free(pc->dirty);
+  ft_memset(pc, 0, sizeof(*pc));
+}
+
+static t_png_scratch *png_scratch(EncodeBuffer *buf) {
+  if (!buf->scratch)
+    buf->scratch = ft_calloc(1, sizeof(t_png_scratch));
+  return (buf->scratch);
+}
+
+void plt_buffer_free(EncodeBuffer *buf) {
+  if (!buf)
+    return;
+  t_png_scratch *sc = buf->scratch;
+  for (int i = 0; sc && i < PLT_MAX_THREADS; i++) {
+    STBIW_FREE(sc->band[i].raw.data);
+    STBIW_FREE(sc->band[i].trial.data);
+    STBIW_FREE(sc->band[i].z.out.data);
+    ft_free(sc->band[i].head);
+    ft_free(sc->band[i].prev);
+  }
+  if (sc) {
+    STBIW_FREE(sc->index.data);
+    png_cache_free(&sc->cache);
+  }
+  ft_free(sc);
+  STBIW_FREE(buf->data);
+  ft_memset(buf, 0, sizeof(*buf));
+}
+
+// scanlines to encode: the canvas itself, or packed palette indices
+typedef struct {
+  const unsigned char *rows;
+  int width, height;
+  int stride; // bytes per scanline
+  int pitch;  // distance between rows in memory
+  int bpp;    // filter distance in bytes
+  int depth, color_type;
+} t_png_image;
+
+// filters rows [y0, y1) into b->raw
+static int png_band_filter(t_png_band *b, const t_png_image *img, int y0,
+                           int y1, int filter) {
+  int n = img->stride;
+  b->raw_len = (size_t)(y1 - y0) * (n + 1);
+  b->raw.len = b->trial.len = 0;
+  if (bytes_reserve(&b->raw, b->raw_len) < 0 ||
+      bytes_reserve(&b->trial, n) < 0)
+    return (-1);
+  png_filter_rows(b->raw.data, img->rows, y0, y1, n, img->pitch, img->bpp,
+                  filter, b->trial.data);
+  return (0);
+}
+
+/*
+
+Parallel PNG encoding.
+
+The image is cut into one band of rows per worker. Each worker filters its
+band, compresses it as a raw deflate segment that ends on a sync flush
+(the last one on a final block), and wraps it into its own IDAT chunk with
+its CRC, the same layout pigz uses for gzip. Segments don't reference each
+other, so decoders see one ordinary zlib stream split over several IDATs.
+The zlib header goes in front of the first segment and the Adler-32 of the
+whole stream, combined from the per-band checksums, is a last 4-byte IDAT.
+Segments are compressed by the built-in compressor (levels above 3 act as
+3), or by the system zlib when built with it. A single band is the same
+thing with the checksum kept inside its IDAT.
+
+*/
+
+#define PLT_PNG_GRAIN (1L << 20) // filtered bytes per worker at least
+
+static unsigned int adler_combine(unsigned int a1, unsigned int a2,
+                                  size_t len2) {
+  unsigned long base = 65521;
+  unsigned long rem = len2 % base;
+  unsigned long sum1 = a1 & 0xFFFF;
+  unsigned long sum2 = (rem * sum1) % base;
+  sum1 += (a2 & 0xFFFF) + base - 1;
+  sum2 += (a1 >> 16) + (a2 >> 16) + base - rem;
+  if (sum1 >= base)
+    sum1 -= base;
+  if (sum1 >= base)
+    sum1 -= base;
+  if (sum2 >= base * 2)
+    sum2 -= base * 2;
+  if (sum2 >= base)
+    sum2 -= base;
+  return ((unsigned int)(sum1 | (sum2 << 16)));
+}
+
+#ifdef FT_MATPLOTLIB_USE_ZLIB
+static void deflate_segment(t_png_band *b, int level, int final) {
+  t_bitout *bo = &b->z;
+  z_stream zs;
+  ft_memset(&zs, 0, sizeof(zs));
+  if (deflateInit2(&zs, level > 9 ? 9 : level, Z_DEFLATED, -15, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    bo->failed = 1;
+    return;
+  }
+  uLong bound = deflateBound(&zs, (uLong)b->raw_len) + 16;
+  if (bytes_reserve(&bo->out, bound) < 0) {
+    deflateEnd(&zs);
+    bo->failed = 1;
+    return;
+  }
+  zs.next_in = b->raw.data;
+  zs.avail_in = (uInt)b->raw_len;
+  zs.next_out = bo->out.data + bo->out.len;
+  zs.avail_out = (uInt)bound;
+  int r = deflate(&zs, final ? Z_FINISH : Z_SYNC_FLUSH);
+  if (r != (final ? Z_STREAM_END : Z_OK))
+    bo->failed = 1;
+  bo->out.len += bound - zs.avail_out;
+  deflateEnd(&zs);
+}
+#else
+static void deflate_segment(t_png_band *b, int level, int final) {
+  if (!b->head)
+    b->head = ft_malloc(sizeof(int) << PLT_DEFLATE_HASH_BITS);
+  if (!b->prev)
+    b->prev = ft_malloc(sizeof(int) * PLT_DEFLATE_WINDOW);
+  if (b->head && b->prev)
+    deflate_raw(&b->z, b->raw.data, b->raw_len, level > 3 ? 3 : level, final,
+                b->head, b->prev);
+  else
+    b->z.failed = 1;
+}
+#endif
+
+typedef struct {
+  const t_png_image *img;
+  const SaveOptions *o;
+  int filter;
+  int nseg;
+  t_png_scratch *sc;
+} t_png_job;
+
+/*
+    Filters and compresses rows [y0, y1) into b->z as one IDAT chunk. first
+    puts the zlib header in front, last ends on a final block, and
+    adler_inside appends the checksum (when this band is the whole image).
+*/
+static void png_band_chunk(t_png_band *b, const t_png_image *img, int y0,
+                           int y1, int filter, int level, int first, int last,
+                           int adler_inside) {
+  t_bitout *bo = &b->z;
+  bo->out.len = 0;
+  bo->bits = 0;
+  bo->nbits = 0;
+  bo->failed = 0;
+  // length and type are filled in below
+  if (png_band_filter(b, img, y0, y1, filter) < 0 ||
+      bytes_reserve(&bo->out, 10) < 0) {
+    bo->failed = 1;
+    return;
+  }
+  bo->out.len = 8;
+  if (first) {
+    bo->out.data[bo->out.len++] = 0x78;
+    bo->out.data[bo->out.len++] = 0x01;
+  }
+  b->adler = adler_update(1, b->raw.data, b->raw_len);
+  deflate_segment(b, level, last);
+  if (bo->failed || bytes_reserve(&bo->out, 8) < 0) {
+    bo->failed = 1;
+    return;
+  }
+  if (adler_inside) {
+    put_be32(bo->out.data + bo->out.len, b->adler);
+    bo->out.len += 4;
+  }
+  put_be32(bo->out.data, (unsigned int)(bo->out.len - 8));
+  ft_memcpy(bo->out.data + 4, "IDAT", 4);
+  put_be32(bo->out.data + bo->out.len,
+           crc_update(0, bo->out.data + 4, bo->out.len - 4));
+  bo->out.len += 4;
+}
+
+static void png_band_task(void *arg, int tid, long y0, long y1) {
+  t_png_job *job = arg;
+  png_band_chunk(&job->sc->band[tid], job->img, (int)y0, (int)y1, job->filter,
+                 job->o->level, tid == 0, tid == job->nseg - 1,
+                 job->nseg == 1);
+}
+
+static void png_encode_bands(const t_png_image *img, const SaveOptions *o,
+                             int filter, t_sink *out, t_png_scratch *sc,
+                             int nseg) {
+  t_png_job job = {img, o, filter, nseg, sc};
+  parallel_for(img->height, nseg, png_band_task, &job);
+  unsigned int adler = sc->band[0].adler;
+  for (int s = 0; s < nseg; s++) {
+    if (sc->band[s].z.failed)
+      out->failed = 1;
+    sink_put(out, sc->band[s].z.out.data, sc->band[s].z.out.len);
+    if (s > 0)
+      adler = adler_combine(adler, sc->band[s].adler, sc->band[s].raw_len);
+  }
+  if (nseg > 1) {
+    unsigned char tail[4];
+    put_be32(tail, adler);
+    png_chunk(out, "IDAT", tail, 4);
+  }
+}
+
+// the band path also serves single-threaded encodes it can compress
+static int png_builtin(const SaveOptions *o) {
+#ifdef FT_MATPLOTLIB_USE_ZLIB
+  return (!o->deflate);
+#else
+  return (!o->deflate && o->level <= 3);
+#endif
+}
+
+// bands for one image: 1 unless the built-in compressors are in use, so a
+// level they cannot honour is never clamped behind the caller's back
+static int png_bands(const t_png_image *img, const SaveOptions *o) {
+  if (!png_builtin(o) || o->threads == 1)
+    return (1);
+  long raw = (long)img->height * (img->stride + 1);
+  int nw = parallel_workers(raw, PLT_PNG_GRAIN);
+  if (o->threads > 1 && nw > o->threads)
+    nw = o->threads;
+  return (nw > img->height ? img->height : nw);
+}
+
+/*
+
+Incremental PNG encoding.
+
+With SaveOptions.incremental, the image is cut into fixed bands of
+PLT_PNG_CACHE_ROWS rows, each compressed like a parallel band: an
+independent deflate segment ending on a sync flush, in its own IDAT chunk.
+The chunks stay in the EncodeBuffer's scratch together with a 64-bit hash
+of the band's rows and of the row above it (which the Up, Average and
+Paeth filters read). The next encode into the same buffer only hashes the
+image and recompresses, in parallel, the bands whose hash changed; the
+others are copied out as they are. A last IDAT holds an empty final block
+and the Adler-32, combined from the per-band checksums. Any change of size,
+pixel format, level or filter starts the cache over.
+
+*/
+
+#define PLT_PNG_CACHE_ROWS 16
+
+// four independent multiply chains, so the loop is not latency bound
+static unsigned long long rows_hash(unsigned long long h,
+                                    const unsigned char *p, size_t n) {
+  const unsigned long long m = 0x9E3779B97F4A7C15ull;
+  unsigned long long l[4] = {h, h ^ 1, h ^ 2, h ^ 3};
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    unsigned long long w[4];
+    ft_memcpy(w, p + i, 32);
+    for (int k = 0; k < 4; k++) {
+      l[k] = (l[k] ^ w[k]) * m;
+      l[k] ^= l[k] >> 32;
+    }
+  }
+  h = ((l[0] * m ^ l[1]) * m ^ l[2]) * m ^ l[3];
+  for (; i < n; i++)
+    h = (h ^ p[i]) * 0x100000001B3ull;
+  return (h ^ (h >> 29));
+}
+
+static int png_cache_setup(t_png_cache *pc, const t_png_image *img,
+                           const SaveOptions *o, int filter) {
+  int nbands = (img->height + PLT_PNG_CACHE_ROWS - 1) / PLT_PNG_CACHE_ROWS;
+  if (pc->valid && pc->width == img->width && pc->height == img->height &&
+      pc->stride == img->stride && pc->depth == img->depth &&
+      pc->color_type == img->color_type && pc->level == o->level &&
+      pc->filter == filter)
+    return (0);
+  png_cache_free(pc);
+  pc->hash = ft_malloc(sizeof(unsigned long long) * nbands);
+  pc->adler = ft_malloc(sizeof(unsigned int) * nbands);
+  pc->raw_len = ft_malloc(sizeof(size_t) * nbands);
+  pc->chunk = ft_calloc(nbands, sizeof(t_bytes));
+  pc->dirty = ft_malloc(sizeof(int) * nbands);
+  pc->nbands = nbands;
+  if (!pc->hash || !pc->adler || !pc->raw_len || !pc->chunk || !pc->dirty) {
+    png_cache_free(pc);
+    return (-1);
+  }
+  pc->width = img->width;
+  pc->height = img->height;
+  pc->stride = img->stride;
+  pc->depth = img->depth;
+  pc->color_type = img->color_type;
+  pc->level = o->level;
+  pc->filter = filter;
+  return (0);
+}
+
+typedef struct {
+  const t_png_image *img;
+  t_png_scratch *sc;
+  int filter, level;
+  int failed[PLT_MAX_THREADS];
+} t_png_cache_job;
+
+static void png_cache_task(void *arg, int tid, long start, long end) {
+  t_png_cache_job *job = arg;
+  t_png_cache *pc = &job->sc->cache;
+  t_png_band *b = &job->sc->band[tid];
+  for (long i = start; i < end; i++) {
+    int k = pc->dirty[i];
+    int y0 = k * PLT_PNG_CACHE_ROWS;
+    int y1 = y0 + PLT_PNG_CACHE_ROWS;
+    if (y1 > job->img->height)
+      y1 = job->img->height;
+    png_band_chunk(b, job->img, y0, y1, job->filter, job->level, k == 0, 0, 0);
+    pc->chunk[k].len = 0;
+    if (b->z.failed ||
+        bytes_put(&pc->chunk[k], b->z.out.data, b->z.out.len) < 0)
+      job->failed[tid] = 1;
+    pc->adler[k] = b->adler;
+    pc->raw_len[k] = b->raw_len;
+  }
+}
+
+static int png_encode_cached(const t_png_image *img, const SaveOptions *o,
+                             int filter, t_sink *out, t_png_scratch *sc) {
+  t_png_cache *pc = &sc->cache;
+  if (png_cache_setup(pc, img, o, filter) < 0)
+    return (-1);
+  int ndirty = 0;
+  size_t dirty_bytes = 0;
+  for (int k = 0; k < pc->nbands; k++) {
+    int y0 = k * PLT_PNG_CACHE_ROWS, y1 = y0 + PLT_PNG_CACHE_ROWS;
+    y1 = y1 < img->height ? y1 : img->height;
+    unsigned long long h = 0xCBF29CE484222325ull;
+    for (int y = y0 > 0 ? y0 - 1 : 0; y < y1; y++)
+      h = rows_hash(h, img->rows + (size_t)y * img->pitch, img->stride);
+    if (!pc->valid || h != pc->hash[k]) {
+      pc->hash[k] = h;
+      pc->dirty[ndirty++] = k;
+      dirty_bytes += (size_t)(y1 - y0) * (img->stride + 1);
+    }
+  }
+  t_png_cache_job job = {img, sc, filter, o->level, {0}};
+  int nw = parallel_workers((long)dirty_bytes, PLT_PNG_GRAIN);
+  if (o->threads > 0 && nw > o->threads)
+    nw = o->threads;
+  parallel_for(ndirty, nw, png_cache_task, &job);
+  pc->valid = 1;
+  for (int t = 0; t < PLT_MAX_THREADS; t++)
+    if (job.failed[t])
+      pc->valid = 0;
+  if (!pc->valid)
+    return (-1);
+  unsigned int adler = pc->adler[0];
+  for (int k = 0; k < pc->nbands; k++) {
+    sink_put(out, pc->chunk[k].data, pc->chunk[k].len);
+    if (k > 0)
+      adler = adler_combine(adler, pc->adler[k], pc->raw_len[k]);
+  }
+  unsigned char tail[9] = {0x01, 0x00, 0x00, 0xFF, 0xFF}; // final empty block
+  put_be32(tail + 5, adler);
+  png_chunk(out, "IDAT", tail, 9);
+  return (0);
+}
+
+static double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec * 1e3 + ts.tv_nsec / 1e6);
+}
+
+/*
+
+Palette mode.
+
+Chart images rarely use more than a handful of colors. palette_index maps
+every pixel to a palette slot through a small open-addressing hash, with
+the previous pixel's color checked first since most pixels repeat it, and
+gives up as soon as a 257th color shows up. The indices are packed to 1,
+2, 4 or 8 bits in place and encoded as a color type 3 PNG. Index rows are
+not filtered, which is what libpng recommends for palette images.
+
+*/
+
+#define PLT_PALETTE_SLOTS 512
+
+// -1 when the w x h pixels (rows pitch bytes apart) use more than 256 colors
+static int palette_index(const unsigned char *rows, int w, int h, int pitch,
+                         unsigned char *pal, int *ncolors, unsigned char *idx) {
+  unsigned int key[PLT_PALETTE_SLOTS];
+  unsigned char val[PLT_PALETTE_SLOTS];
+  ft_memset(key, 0, sizeof(key));
+  unsigned int last = 0xFFFFFFFF;
+  unsigned char last_idx = 0;
+  int n = 0;
+  size_t i = 0;
+  for (int y = 0; y < h; y++) {
+    const unsigned char *p = rows + (size_t)y * pitch;
+    for (int x = 0; x < w; x++, p += 3, i++) {
+      unsigned int rgb = 0x1000000u | p[0] << 16 | p[1] << 8 | p[2];
+      if (rgb != last) {
+        unsigned int slot = (rgb * 2654435761u) >> 23;
+        while (key[slot] && key[slot] != rgb)
+          slot = (slot + 1) & (PLT_PALETTE_SLOTS - 1);
+        if (!key[slot]) {
+          if (n == 256)
+            return (-1);
+          key[slot] = rgb;
+          val[slot] = (unsigned char)n;
+          ft_memcpy(pal + 3 * n++, p, 3);
+        }
+        last = rgb;
+        last_idx = val[slot];
+      }
+      idx[i] = last_idx;
+    }
+  }
+  *ncolors = n;
+  return (0);
+}
+
+// packs rows of one index per byte to depth bits, in place; returns stride
+static int palette_pack(unsigned char *idx, int w, int h, int depth) {
+  int stride = (w * depth + 7) / 8;
+  if (depth == 8)
+    return (stride);
+  int per = 8 / depth;
+  for (int y = 0; y < h; y++) {
+    const unsigned char *src = idx + (size_t)y * w;
+    unsigned char *dst = idx + (size_t)y * stride;
+    for (int x = 0; x < w; x += per) {
+      unsigned char v = 0;
+      for (int k = 0; k < per; k++)
+        v = (unsigned char)(v << depth | (x + k < w ? src[x + k] : 0));
+      dst[x / per] = v;
+    }
+  }
+  return (stride);
+}
+
+static int png_encode_image(const t_png_image *img, const SaveOptions *o,
+                            int filter, const unsigned char *pal, int npal,
+                            t_sink *out, t_png_scratch *sc) {
+  int nseg = png_bands(img, o);
+  png_header(out, img->width, img->height, img->depth, img->color_type);
+  if (pal)
+    png_chunk(out, "PLTE", pal, (size_t)npal * 3);
+  if (o->incremental && !o->deflate) {
+    if (png_encode_cached(img, o, filter, out, sc) < 0)
+      return (-1);
+  } else if (nseg > 1 || png_builtin(o)) {
+    png_encode_bands(img, o, filter, out, sc, nseg);
+  } else {
+    t_png_band *b = &sc->band[0];
+    int zlen = 0;
+    unsigned char *z = NULL;
+    if (png_band_filter(b, img, 0, img->height, filter) == 0)
+      z = deflate_backend(o)(b->raw.data, (int)b->raw_len, &zlen, o->level);
+    if (!z)
+      return (-1);
+    png_chunk(out, "IDAT", z, (size_t)zlen);
+    STBIW_FREE(z);
+  }
+  png_chunk(out, "IEND", NULL, 0);
+  return (out->failed ? -1 : 0);
+}
+
+// complete PNG of c written to out, indexed when opts and colors allow
+static int png_encode(const Canvas *c, const SaveOptions *o, t_sink *out,
+                      t_png_scratch *sc) {
+  pthread_once(&g_png_tables_once, png_tables_init);
+  t_png_image img = {c->pixels,     c->width, c->height, c->width * 3,
+                     c->width * 3, 3,        8,         2};
+  if (o->palette) {
+    unsigned char pal[256 * 3];
+    int npal = 0;
+    t_bytes *idx = &sc->index;
+    idx->len = 0;
+    if (bytes_reserve(idx, (size_t)c->width * c->height) == 0 &&
+        palette_index(c->pixels, c->width, c->height, c->width * 3, pal, &npal,
+                      idx->data) == 0) {
+      int depth = npal <= 2 ? 1 : npal <= 4 ? 2 : npal <= 16 ? 4 : 8;
+      int stride = palette_pack(idx->data, c->width, c->height, depth);
+      t_png_image pimg = {idx->data, c->width, c->height, stride,
+                          stride,    1,        depth,     3};
+      return (png_encode_image(&pimg, o, PLT_FILTER_NONE, pal, npal, out, sc));
+    }
+  }
+  return (png_encode_image(&img, o, o->filter, NULL, 0, out, sc));
+}
+
+/*
+
+Other output formats.
+
+PPM, PAM and the raw format are a short header followed by Canvas.pixels
+unchanged, so a file save is one writev straight from the canvas and an
+in-memory encode one memcpy. BMP stores rows bottom-up as padded BGR and
+QOI is a single pass over the pixels; both are built in the scratch
+buffers of the EncodeBuffer. The raw header is 16 bytes: "PLTR" and then
+width, height and channels (3) as little-endian 32-bit integers.
+
+*/
+
+static void put_le32(unsigned char *p, unsigned int v) {
+  p[0] = (unsigned char)v;
+  p[1] = (unsigned char)(v >> 8);
+  p[2] = (unsigned char)(v >> 16);
+  p[3] = (unsigned char)(v >> 24);
+}
+
+// case-insensitive check of a 4 character extension such as ".png"
+static int has_ext(const char *filename, const char *ext) {
+  size_t n = ft_strlen(filename);
+  if (n < 4)
+    return (0);
+  for (int i = 0; i < 4; i++) {
+    char ch = filename[n - 4 + i];
+    if (ch >= 'A' && ch <= 'Z')
+      ch += 'a' - 'A';
+    if (ch != ext[i])
+      return (0);
+  }
+  return (1);
+}
+
+static int format_from_name(const char *filename) {
+  static const struct {
+    const char *ext;
+    int format;
+  } exts[] = {{".png", PLT_FORMAT_PNG}, {".ppm", PLT_FORMAT_PPM},
+              {".pam", PLT_FORMAT_PAM}, {".bmp", PLT_FORMAT_BMP},
+              {".raw", PLT_FORMAT_RAW}, {".rgb", PLT_FORMAT_RAW},
+              {".qoi", PLT_FORMAT_QOI}};
+  for (size_t e = 0; e < sizeof(exts) / sizeof(exts[0]); e++)
+    if (has_ext(filename, exts[e].ext))
+      return (exts[e].format);
+  return (PLT_FORMAT_PNG);
+}
+
+// header of the formats that store Canvas.pixels as is, 0 for the others
+static int raw_header(const Canvas *c, int format, unsigned char *hdr) {
+  if (format == PLT_FORMAT_PPM)
+    return (snprintf((char *)hdr, 64, "P6\n%d %d\n255\n", c->width,
+                     c->height));
+  if (format == PLT_FORMAT_PAM)
+    return (snprintf((char *)hdr, 128,
+                     "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 3\nMAXVAL 255\n"
+                     "TUPLTYPE RGB\nENDHDR\n",
+                     c->width, c->height));
+  if (format == PLT_FORMAT_RAW) {
+    ft_memcpy(hdr, "PLTR", 4);
+    put_le32(hdr + 4, (unsigned int)c->width);
+    put_le32(hdr + 8, (unsigned int)c->height);
+    put_le32(hdr + 12, 3);
+    return (16);
+  }
+  return (0);
+}
+
+static int bmp_encode(const Canvas *c, t_sink *out, t_png_scratch *sc) {
+  int pad = (4 - (c->width * 3) % 4) % 4;
+  size_t row = (size_t)c->width * 3 + pad;
+  size_t size = 54 + row * c->height;
+  unsigned char hdr[54];
+  ft_memset(hdr, 0, sizeof(hdr));
+  hdr[0] = 'B';
+  hdr[1] = 'M';
+  put_le32(hdr + 2, (unsigned int)size);
+  put_le32(hdr + 10, 54);
+  put_le32(hdr + 14, 40);
+  put_le32(hdr + 18, (unsigned int)c->width);
+  put_le32(hdr + 22, (unsigned int)c->height);
+  hdr[26] = 1;  // planes
+  hdr[28] = 24; // bits per pixel
+  put_le32(hdr + 34, (unsigned int)(row * c->height));
+  t_bytes *buf = &sc->band[0].raw;
+  buf->len = 0;
+  if (bytes_reserve(buf, row * c->height) < 0)
+    return (-1);
+  for (int y = 0; y < c->height; y++) {
+    const unsigned char *src = c->pixels + (size_t)(c->height - 1 - y) *
+                                               c->width * 3;
+    unsigned char *dst = buf->data + row * y;
+    for (int x = 0; x < c->width; x++, src += 3, dst += 3) {
+      dst[0] = src[2];
+      dst[1] = src[1];
+      dst[2] = src[0];
+    }
+    for (int p = 0; p < pad; p++)
+      dst[p] = 0;
+  }
+  sink_put(out, hdr, 54);
+  sink_put(out, buf->data, row * c->height);
+  return (out->failed ? -1 : 0);
+}
+
+static int qoi_encode(const Canvas *c, t_sink *out, t_png_scratch *sc) {
+  size_t npix = (size_t)c->width * c->height;
+  t_bytes *buf = &sc->band[0].raw;
+  buf->len = 0;
+  if (bytes_reserve(buf, 14 + npix * 4 + 8) < 0)
+    return (-1);
+  unsigned char *p = buf->data;
+  ft_memcpy(p, "qoif", 4);
+  put_be32(p + 4, (unsigned int)c->width);
+  put_be32(p + 8, (unsigned int)c->height);
+  p[12] = 3; // channels
+  p[13] = 0; // sRGB with linear alpha
+  p += 14;
+  unsigned char index[64][4]; // RGBA, all zero like the decoder's
+  ft_memset(index, 0, sizeof(index));
+  unsigned char pr = 0, pg = 0, pb = 0;
+  int run = 0;
+  const unsigned char *px = c->pixels;
+  for (size_t i = 0; i < npix; i++, px += 3) {
+    unsigned char r = px[0], g = px[1], b = px[2];
+    if (r == pr && g == pg && b == pb) {
+      if (++run == 62 || i == npix - 1) {
+        *p++ = (unsigned char)(0xC0 | (run - 1));
+        run = 0;
+      }
+      continue;
+    }
+    if (run > 0) {
+      *p++ = (unsigned char)(0xC0 | (run - 1));
+      run = 0;
+    }
+    int h = (r * 3 + g * 5 + b * 7 + 255 * 11) % 64;
+    if (index[h][0] == r && index[h][1] == g && index[h][2] == b &&
+        index[h][3] == 255) {
+      *p++ = (unsigned char)h;
+    } else {
+      index[h][0] = r;
+      index[h][1] = g;
+      index[h][2] = b;
+      index[h][3] = 255;
+      signed char vr = (signed char)(r - pr), vg = (signed char)(g - pg),
+                  vb = (signed char)(b - pb);
+      signed char vg_r = (signed char)(vr - vg), vg_b = (signed char)(vb - vg);
+      if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+        *p++ = (unsigned char)(0x40 | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2));
+      } else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 &&
+                 vg_b < 8) {
+        *p++ = (unsigned char)(0x80 | (vg + 32));
+        *p++ = (unsigned char)((vg_r + 8) << 4 | (vg_b + 8));
+      } else {
+        *p++ = 0xFE;
+        *p++ = r;
+        *p++ = g;
+        *p++ = b;
+      }
+    }
+    pr = r;
+    pg = g;
+    pb = b;
+  }
+  static const unsigned char end[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+  ft_memcpy(p, end, 8);
+  p += 8;
+  sink_put(out, buf->data, (size_t)(p - buf->data));
+  return (out->failed ? -1 : 0);
+}
+
+static int encode_format(const Canvas *c, int format, const SaveOptions *o,
+                         t_sink *out, t_png_scratch *sc) {
+  unsigned char hdr[128];
+  int hlen = raw_header(c, format, hdr);
+  if (hlen > 0) {
+    sink_put(out, hdr, (size_t)hlen);
+    sink_put(out, c->pixels, (size_t)c->width * c->height * 3);
+    return (out->failed ? -1 : 0);
+  }
+  if (format == PLT_FORMAT_BMP)
+    return (bmp_encode(c, out, sc));
+  if (format == PLT_FORMAT_QOI)
+    return (qoi_encode(c, out, sc));
+  return (png_encode(c, o, out, sc));
+}
+
+static int encode_check(Canvas *c, SaveOptions *o, const char *who) {
+  if (!c || !c->pixels) {
+    ft_printf("Error: %s received NULL canvas\n", who);
+    return (-1);
+  }
+  if (o->filter < PLT_FILTER_HEURISTIC || o->filter > PLT_FILTER_PAETH) {
+    ft_printf("Error: %s invalid filter %d\n", who, o->filter);
+    return (-1);
+  }
+  if (o->format < PLT_FORMAT_AUTO || o->format > PLT_FORMAT_QOI) {
+    ft_printf("Error: %s invalid format %d\n", who, o->format);
+    return (-1);
+  }
+  return (0);
+}
+
+// encodes into buf->data (or through func when set), timing the work
+static int encode_image(Canvas *c, EncodeBuffer *buf, stbi_write_func *func,
+                        void *ctx, SaveOptions *opts, int format,
+                        const char *who) {
+  SaveOptions def = plt_save_options();
+  SaveOptions *o = opts ? opts : &def;
+  if (!buf || encode_check(c, o, who) < 0)
+    return (-1);
+  if (format == PLT_FORMAT_AUTO)
+    format = o->format == PLT_FORMAT_AUTO ? PLT_FORMAT_PNG : o->format;
+  t_png_scratch *sc = png_scratch(buf);
+  if (!sc)
+    return (-1);
+  double t0 = now_ms();
+  t_bytes bytes = {buf->data, 0, buf->cap};
+  t_sink out = {&bytes, func, ctx, 0, 0};
+  int ret = encode_format(c, format, o, &out, sc);
+  buf->data = bytes.data;
+  buf->cap = bytes.cap;
+  buf->len = func ? 0 : bytes.len;
+  o->encode_ms = now_ms() - t0;
+  o->bytes = ret == 0 ? (long)out.len : 0;
+  if (ret < 0)
+    ft_printf("Error: %s: encoding failed\n", who);
+  return (ret);
+}
+
+int plt_encode(Canvas *c, EncodeBuffer *buf, SaveOptions *opts) {
+  return (encode_image(c, buf, NULL, NULL, opts, PLT_FORMAT_AUTO,
+                       "plt_encode"));
+}
+
+int plt_encode_to_func(Canvas *c, stbi_write_func *func, void *ctx,
+                       EncodeBuffer *work, SaveOptions *opts) {
+  if (!func) {
+    ft_printf("Error: plt_encode_to_func received NULL func\n");
+    return (-1);
+  }
+  return (encode_image(c, work, func, ctx, opts, PLT_FORMAT_AUTO,
+                       "plt_encode_to_func"));
+}
+
+int plt_encode_png(Canvas *c, EncodeBuffer *buf, SaveOptions *opts) {
+  return (encode_image(c, buf, NULL, NULL, opts, PLT_FORMAT_PNG,
+                       "plt_encode_png"));
+}
+
+int plt_encode_png_to_func(Canvas *c, stbi_write_func *func, void *ctx,
+                           EncodeBuffer *work, SaveOptions *opts) {
+  if (!func) {
+    ft_printf("Error: plt_encode_png_to_func received NULL func\n");
+    return (-1);
+  }
+  return (encode_image(c, work, func, ctx, opts, PLT_FORMAT_PNG,
+                       "plt_encode_png_to_func"));
+}
+
+int plt_encode_damage(Canvas *c, EncodeBuffer *buf) {
+  if (!c || !c->pixels || !buf) {
+    ft_printf("Error: plt_encode_damage: invalid arguments\n");
+    return (-1);
+  }
+  Rect all = {0, 0, c->width, c->height};
+  const Rect *rects = c->damage ? c->damage->rects : &all;
+  int nrects = c->damage ? c->damage->nrects : 1;
+  size_t total = 16;
+  for (int k = 0; k < nrects; k++)
+    total += 16 + (size_t)rects[k].w * rects[k].h * 3;
+  t_bytes out = {buf->data, 0, buf->cap};
+  if (bytes_reserve(&out, total) < 0) {
+    buf->data = out.data;
+    ft_printf("Error: plt_encode_damage: out of memory\n");
+    return (-1);
+  }
+  unsigned char *p = out.data;
+  ft_memcpy(p, "PLTU", 4);
+  put_le32(p + 4, (unsigned int)c->width);
+  put_le32(p + 8, (unsigned int)c->height);
+  put_le32(p + 12, (unsigned int)nrects);
+  p += 16;
+  for (int k = 0; k < nrects; k++) {
+    const Rect *r = &rects[k];
+    put_le32(p, (unsigned int)r->x);
+    put_le32(p + 4, (unsigned int)r->y);
+    put_le32(p + 8, (unsigned int)r->w);
+    put_le32(p + 12, (unsigned int)r->h);
+    p += 16;
+    for (int y = r->y; y < r->y + r->h; y++, p += (size_t)r->w * 3)
+      ft_memcpy(p, c->pixels + ((size_t)y * c->width + r->x) * 3,
+                (size_t)r->w * 3);
+  }
+  buf->data = out.data;
+  buf->cap = out.cap;
+  buf->len = total;
+  return (0);
+}
+
+// writes all of iov, restarting after partial writes
+static int writev_all(int fd, struct iovec *iov, int n) {
+  while (n > 0) {
+    ssize_t k = writev(fd, iov, n);
+    if (k < 0 && errno == EINTR)
+      continue;
+    if (k < 0)
+      return (-1);
+    while (n > 0 && (size_t)k >= iov->iov_len) {
+      k -= (ssize_t)iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (char *)iov->iov_base + k;
+      iov->iov_len -= (size_t)k;
+    }
+  }
+  return (0);
+}
+
+static int write_file(const char *filename, struct iovec *iov, int n) {
+  int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    ft_printf("Error: cannot open %s\n", filename);
+    return (-1);
+  }
+  if (writev_all(fd, iov, n) < 0) {
+    ft_printf("Error: write to %s failed\n", filename);
+    close(fd);
+    return (-1);
+  }
+  return (close(fd));
+}
+
+SaveOptions plt_save_options(void) {
+  SaveOptions o;
+  ft_memset(&o, 0, sizeof(o));
+  o.level = 2;
+  o.filter = PLT_FILTER_UP;
+  o.palette = 1;
+  return (o);
+}
+
+// file save with the caller's scratch; o already checked
+static int save_canvas(Canvas *c, const char *filename, SaveOptions *o,
+                       EncodeBuffer *work) {
+  int format = o->format ? o->format : format_from_name(filename);
+  unsigned char hdr[128];
+  int hlen = raw_header(c, format, hdr);
+  int ret;
+  if (hlen > 0) {
+    // header and pixels go to the file as they are
+    double t0 = now_ms();
+    struct iovec iov[2] = {{hdr, (size_t)hlen},
+                           {c->pixels, (size_t)c->width * c->height * 3}};
+    o->bytes = (long)(iov[0].iov_len + iov[1].iov_len);
+    ret = write_file(filename, iov, 2);
+    o->encode_ms = now_ms() - t0;
+  } else {
+    ret = encode_image(c, work, NULL, NULL, o, format, "plt_savefig_opts");
+    struct iovec iov[1] = {{work->data, work->len}};
+    if (ret == 0)
+      ret = write_file(filename, iov, 1);
+  }
+  if (ret < 0)
+    o->bytes = 0;
+  return (ret);
+}
+
+int plt_savefig_buffer(Canvas *c, const char *filename, EncodeBuffer *work,
+                       SaveOptions *opts) {
+  if (!filename || !work) {
+    ft_printf("Error: plt_savefig_buffer received NULL filename or buffer\n");
+    return (-1);
+  }
+  SaveOptions def = plt_save_options();
+  SaveOptions *o = opts ? opts : &def;
+  if (encode_check(c, o, "plt_savefig_buffer") < 0)
+    return (-1);
+  return (save_canvas(c, filename, o, work));
+}
+
+int plt_savefig_opts(Canvas *c, const char *filename, SaveOptions *opts) {
+  if (!filename) {
+    ft_printf("Error: plt_savefig_opts received NULL filename\n");
+    return (-1);
+  }
+  SaveOptions def = plt_save_options();
+  SaveOptions *o = opts ? opts : &def;
+  if (encode_check(c, o, "plt_savefig_opts") < 0)
+    return (-1);
+  EncodeBuffer buf = {NULL, 0, 0, NULL};
+  int ret = save_canvas(c, filename, o, &buf);
+  plt_buffer_free(&buf);
+  return (ret);
+}
+
+/*
+
+Asynchronous saves.
+
+plt_savefig_async copies the canvas pixels and the file name into a job
+and returns at once, so the caller can draw the next figure into the same
+canvas. A pool of encoder threads, started on first use, takes jobs in
+order and saves them with plt_savefig_opts semantics, each with its own
+EncodeBuffer so the encoders' scratch is reused from job to job. At most
+depth jobs wait in the queue: a submit beyond that blocks until an encoder
+frees a slot, which bounds the memory held by snapshots. A SaveHandle is
+owned by both the caller and the queue and freed when both let go.
+
+*/
+
+struct s_save_handle {
+  Canvas snap;
+  char *filename;
+  SaveOptions opts;
+  int done, result, refs;
+  struct s_save_handle *next;
+};
+
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty, not_full, done;
+  SaveHandle *head, *tail;
+  int queued, active, depth, nthreads, failures, stop, started;
+  int stopping; // a shutdown is joining the threads; submits wait for it
+  pthread_t th[PLT_MAX_THREADS];
+} t_save_queue;
+
+static t_save_queue g_saveq = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                               .not_empty = PTHREAD_COND_INITIALIZER,
+                               .not_full = PTHREAD_COND_INITIALIZER,
+                               .done = PTHREAD_COND_INITIALIZER};
+
+// drops one reference; called with the lock held
+static void save_handle_unref(SaveHandle *h) {
+  if (--h->refs > 0)
+    return;
+  ft_free(h->snap.pixels);
+  ft_free(h->filename);
+  ft_free(h);
+}
+
+static void *save_worker(void *arg) {
+  t_save_queue *q = arg;
+  EncodeBuffer work = {NULL, 0, 0, NULL};
+  pthread_mutex_lock(&q->lock);
+  for (;;) {
+    while (!q->head && !q->stop)
+      pthread_cond_wait(&q->not_empty, &q->lock);
+    if (!q->head)
+      break;
+    SaveHandle *h = q->head;
+    q->head = h->next;
+    if (!q->head)
+      q->tail = NULL;
+    q->queued--;
+    q->active++;
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+
+    int ret = save_canvas(&h->snap, h->filename, &h->opts, &work);
+
+    pthread_mutex_lock(&q->lock);
+    h->result = ret;
+    h->done = 1;
+    q->failures += ret < 0;
+    q->active--;
+    ft_free(h->snap.pixels); // the result is all the caller can still read
+    h->snap.pixels = NULL;
+    save_handle_unref(h);
+    pthread_cond_broadcast(&q->done);
+  }
+  pthread_mutex_unlock(&q->lock);
+  plt_buffer_free(&work);
+  return (NULL);
+}
+
+// starts the pool; called with the lock held
+static int save_queue_start(t_save_queue *q, int nthreads, int depth) {
+  if (nthreads <= 0)
+    nthreads = plt_get_threads();
+  if (nthreads > PLT_MAX_THREADS)
+    nthreads = PLT_MAX_THREADS;
+  q->depth = depth > 0 ? depth : 2 * nthreads;
+  q->stop = 0;
+  q->nthreads = 0;
+  for (int i = 0; i < nthreads; i++)
+    if (pthread_create(&q->th[q->nthreads], NULL, save_worker, q) == 0)
+      q->nthreads++;
+  q->started = q->nthreads > 0;
+  return (q->started ? 0 : -1);
+}
+
+int plt_flush(void) {
+  t_save_queue *q = &g_saveq;
+  pthread_mutex_lock(&q->lock);
+  while (q->queued > 0 || q->active > 0)
+    pthread_cond_wait(&q->done, &q->lock);
+  int failures = q->failures;
+  q->failures = 0;
+  pthread_mutex_unlock(&q->lock);
+  return (failures);
+}
+
+// closes the queue to new jobs first, so the workers' drain always ends
+int plt_save_queue_shutdown(void) {
+  t_save_queue *q = &g_saveq;
+  pthread_mutex_lock(&q->lock);
+  while (q->stopping)
+    pthread_cond_wait(&q->done, &q->lock);
+  int n = q->started ? q->nthreads : 0;
+  q->stop = 1;
+  q->started = 0;
+  q->stopping = 1;
+  pthread_cond_broadcast(&q->not_empty);
+  pthread_cond_broadcast(&q->not_full);
+  pthread_mutex_unlock(&q->lock);
+  for (int i = 0; i < n; i++) // workers exit once the queue is empty
+    pthread_join(q->th[i], NULL);
+  pthread_mutex_lock(&q->lock);
+  int failures = q->failures;
+  q->failures = 0;
+  q->stopping = 0;
+  pthread_cond_broadcast(&q->done);
+  pthread_mutex_unlock(&q->lock);
+  return (failures);
+}
+
+int plt_save_queue_init(int nthreads, int depth) {
+  plt_save_queue_shutdown();
+  pthread_mutex_lock(&g_saveq.lock);
+  while (g_saveq.stopping)
+    pthread_cond_wait(&g_saveq.done, &g_saveq.lock);
+  int ret = g_saveq.started ? 0 : save_queue_start(&g_saveq, nthreads, depth);
+  pthread_mutex_unlock(&g_saveq.lock);
+  if (ret < 0)
+    ft_printf("Error: plt_save_queue_init could not start threads\n");
+  return (ret);
+}
+
+SaveHandle *plt_savefig_async(Canvas *c, const char *filename,
+                              const SaveOptions *opts) {
+  SaveOptions o = opts ? *opts : plt_save_options();
+  if (!filename || encode_check(c, &o, "plt_savefig_async") < 0)
+    return (NULL);
+  if (o.threads == 0)
+    o.threads = 1; // the pool already keeps the cores busy
+  SaveHandle *h = ft_calloc(1, sizeof(SaveHandle));
+  size_t npix = (size_t)c->width * c->height * 3;
+  size_t nlen = ft_strlen(filename) + 1;
+  if (h) {
+    h->snap.pixels = ft_malloc(npix);
+    h->filename = ft_malloc(nlen);
+  }
+  if (!h || !h->snap.pixels || !h->filename) {
+    if (h) {
+      ft_free(h->snap.pixels);
+      ft_free(h->filename);
+    }
+    ft_free(h);
+    ft_printf("Error: plt_savefig_async out of memory\n");
+    return (NULL);
+  }
+  ft_memcpy(h->snap.pixels, c->pixels, npix);
+  ft_memcpy(h->filename, filename, nlen);
+  h->snap.width = c->width;
+  h->snap.height = c->height;
+  h->opts = o;
+  h->refs = 2; // caller and queue
+
+  t_save_queue *q = &g_saveq;
+  pthread_mutex_lock(&q->lock);
+  for (;;) {
+    // a pool being shut down takes no more jobs: wait, then start a new one
+    while (q->stopping)
+      pthread_cond_wait(&q->done, &q->lock);
+    if (!q->started && save_queue_start(q, 0, 0) < 0) {
+      pthread_mutex_unlock(&q->lock);
+      ft_free(h->snap.pixels);
+      ft_free(h->filename);
+      ft_free(h);
+      ft_printf("Error: plt_savefig_async could not start threads\n");
+      return (NULL);
+    }
+    if (q->queued < q->depth)
+      break;
+    pthread_cond_wait(&q->not_full, &q->lock);
+  }
+  if (q->tail)
+    q->tail->next = h;
+  else
+    q->head = h;
+  q->tail = h;
+  q->queued++;
+  pthread_cond_signal(&q->not_empty);
+  pthread_mutex_unlock(&q->lock);
+  return (h);
+}
+
+int plt_save_done(SaveHandle *h) {
+  if (!h)
+    return (-1);
+  pthread_mutex_lock(&g_saveq.lock);
+  int done = h->done;
+  pthread_mutex_unlock(&g_saveq.lock);
+  return (done);
+}
+
+int plt_save_wait(SaveHandle *h) {
+  if (!h)
+    return (-1);
+  pthread_mutex_lock(&g_saveq.lock);
+  while (!h->done)
+    pthread_cond_wait(&g_saveq.done, &g_saveq.lock);
+  int ret = h->result;
+  save_handle_unref(h);
+  pthread_mutex_unlock(&g_saveq.lock);
+  return (ret);
+}
+
+void plt_save_release(SaveHandle *h) {
+  if (!h)
+    return;
+  pthread_mutex_lock(&g_saveq.lock);
+  save_handle_unref(h);
+  pthread_mutex_unlock(&g_saveq.lock);
+}
+
+/*
+
+Batch rendering.
+
+plt_batch_run hands every worker a contiguous range of the job array. A
+worker pops jobs from the front of its own range; when that runs dry it
+steals the back half of another worker's range, so a few slow figures
+cannot leave the other cores idle. Each range has its own mutex, held for
+a few instructions per job. Each worker owns a canvas and an EncodeBuffer
+that live as long as the Batch, so pixels and encoder scratch are allocated
+once per thread rather than once per figure. Jobs only share the thread
+count, the PNG tables (built once) and the save queue (locked), so they
+can draw and save concurrently. While a job runs, plt_get_threads returns 1
+on its thread: the pool already fills the cores, and nested parallel_for
+threads would only compete with it.
+
+*/
+
+typedef struct {
+  pthread_mutex_t lock;
+  long lo, hi; // jobs still queued on this worker: [lo, hi)
+  Canvas canvas;
+  EncodeBuffer work;
+  long failures;
+  int id;
+  Batch *batch;
+} t_batch_worker;
+
+struct s_batch {
+  int nworkers;
+  t_batch_worker *w;
+  BatchJob *jobs;
+  int nactive; // workers taking part in the current run
+};
+
+Batch *plt_batch_create(int nthreads, int width, int height) {
+  if (width <= 0 || height <= 0) {
+    ft_printf("Error: plt_batch_create: invalid size %dx%d\n", width, height);
+    return (NULL);
+  }
+  if (nthreads <= 0)
+    nthreads = plt_get_threads();
+  if (nthreads > PLT_MAX_THREADS)
+    nthreads = PLT_MAX_THREADS;
+  Batch *b = ft_calloc(1, sizeof(Batch));
+  if (b)
+    b->w = ft_calloc(nthreads, sizeof(t_batch_worker));
+  if (!b || !b->w) {
+    ft_free(b);
+    ft_printf("Error: plt_batch_create out of memory\n");
+    return (NULL);
+  }
+  size_t npix = (size_t)width * height * 3;
+  for (int i = 0; i < nthreads; i++) {
+    t_batch_worker *w = &b->w[i];
+    w->canvas.pixels = ft_malloc(npix);
+    if (!w->canvas.pixels) {
+      plt_batch_destroy(b);
+      ft_printf("Error: plt_batch_create out of memory\n");
+      return (NULL);
+    }
+    pthread_mutex_init(&w->lock, NULL);
+    w->canvas.width = width;
+    w->canvas.height = height;
+    w->id = i;
+    w->batch = b;
+    b->nworkers++;
+  }
+  return (b);
+}
+
+void plt_batch_destroy(Batch *b) {
+  if (!b)
+    return;
+  for (int i = 0; i < b->nworkers; i++) {
+    pthread_mutex_destroy(&b->w[i].lock);
+    ft_free(b->w[i].canvas.pixels);
+    ft_free(b->w[i].canvas.damage);
+    plt_buffer_free(&b->w[i].work);
+  }
+  ft_free(b->w);
+  ft_free(b);
+}
+
+static long batch_pop(t_batch_worker *w) {
+  pthread_mutex_lock(&w->lock);
+  long i = w->lo < w->hi ? w->lo++ : -1;
+  pthread_mutex_unlock(&w->lock);
+  return (i);
+}
+
+// moves the back half of another worker's range to w; 0 when all are empty
+static int batch_steal(t_batch_worker *w) {
+  Batch *b = w->batch;
+  for (int k = 1; k < b->nactive; k++) {
+    t_batch_worker *v = &b->w[(w->id + k) % b->nactive];
+    pthread_mutex_lock(&v->lock);
+    long n = v->hi - v->lo;
+    long lo = v->hi - (n + 1) / 2, hi = v->hi;
+    if (n > 0)
+      v->hi = lo;
+    pthread_mutex_unlock(&v->lock);
+    if (n > 0) {
+      pthread_mutex_lock(&w->lock);
+      w->lo = lo;
+      w->hi = hi;
+      pthread_mutex_unlock(&w->lock);
+      return (1);
+    }
+  }
+  return (0);
+}
+
+static void batch_job(t_batch_worker *w, BatchJob *job) {
+  Canvas *c = &w->canvas;
+  ft_memset(c->pixels, 255, (size_t)c->width * c->height * 3); // white
+  c->record = NULL;
+  c->clip_y0 = 0;
+  c->clip_y1 = 0;
+  plt_damage_reset(c);
+  double t0 = now_ms();
+  job->result = job->fn ? job->fn(c, &w->work, job->user) : -1;
+  job->ms = now_ms() - t0;
+  job->worker = w->id;
+  w->failures += job->result < 0;
+}
+
+static void *batch_worker(void *arg) {
+  t_batch_worker *w = arg;
+  int serial = g_plt_serial;
+  g_plt_serial = 1;
+  for (;;) {
+    long i = batch_pop(w);
+    if (i >= 0)
+      batch_job(w, &w->batch->jobs[i]);
+    else if (!batch_steal(w))
+      break;
+  }
+  g_plt_serial = serial;
+  return (NULL);
+}
+
+long plt_batch_run(Batch *b, BatchJob *jobs, long njobs) {
+  if (!b || (!jobs && njobs > 0) || njobs < 0) {
+    ft_printf("Error: plt_batch_run: invalid arguments\n");
+    return (-1);
+  }
+  int nw = njobs < b->nworkers ? (int)njobs : b->nworkers;
+  pthread_t th[PLT_MAX_THREADS];
+  int started[PLT_MAX_THREADS];
+  b->jobs = jobs;
+  b->nactive = nw;
+  for (long i = 0; i < njobs; i++) {
+    jobs[i].result = -1;
+    jobs[i].ms = 0;
+    jobs[i].worker = -1;
+  }
+  for (int t = 0; t < nw; t++) {
+    b->w[t].lo = njobs * t / nw;
+    b->w[t].hi = njobs * (t + 1) / nw;
+    b->w[t].failures = 0;
+  }
+  // a worker whose thread fails to start has its range stolen by the rest
+  for (int t = 1; t < nw; t++)
+    started[t] = pthread_create(&th[t], NULL, batch_worker, &b->w[t]) == 0;
+  if (nw > 0)
+    batch_worker(&b->w[0]);
+  long failures = 0;
+  for (int t = 0; t < nw; t++) {
+    if (t > 0 && started[t])
+      pthread_join(th[t], NULL);
+    failures += b->w[t].failures;
+  }
+  b->jobs = NULL;
+  return (failures);
+}
+
+/*
+
+Animations.
+
+plt_anim_frame compares each canvas with the previous frame and encodes
+only the bounding box of the changed pixels, placed at its offset; the
+rest of the frame is left as it was (APNG dispose NONE with blend SOURCE,
+GIF "do not dispose"). A frame identical to the previous one only adds its
+delay to it, which is why each frame is held back until the next one
+arrives. APNG frames are RGB PNG data in fdAT chunks; the frame count in
+acTL is patched when the file is closed. GIF frames carry their own color
+table: exact when the changed box has at most 256 colors, otherwise the
+box is mapped to a 6x6x6 color cube (lossy), then LZW coded. On a canvas
+that tracks damage only the damaged rectangles are compared.
+
+*/
+
+struct s_animation {
+  int fd, format, width, height, loops, nframes;
+  unsigned char *prev; // last frame written
+  SaveOptions opts;
+  EncodeBuffer work;
+  t_bytes out;   // bytes not written yet
+  int pending;   // a frame is waiting for its final delay
+  int px, py, pw, ph, pdelay;
+  t_bytes pdata; // APNG: zlib stream, GIF: image descriptor to terminator
+  unsigned int seq;
+  int failed;
+};
+
+static void put_le16(unsigned char *p, unsigned int v) {
+  p[0] = (unsigned char)v;
+  p[1] = (unsigned char)(v >> 8);
+}
+
+// changed box of c against prev; 0 when nothing changed
+static int anim_diff(const Animation *a, const Canvas *c, int *x0, int *y0,
+                     int *x1, int *y1) {
+  size_t pitch = (size_t)a->width * 3;
+  Rect all = {0, 0, a->width, a->height};
+  const Rect *rects = c->damage ? c->damage->rects : &all;
+  int nrects = c->damage ? c->damage->nrects : 1;
+  *x0 = a->width;
+  *y0 = a->height;
+  *x1 = *y1 = -1;
+  for (int k = 0; k < nrects; k++) {
+    const Rect *rc = &rects[k];
+    size_t n = (size_t)rc->w * 3;
+    for (int y = rc->y; y < rc->y + rc->h; y++) {
+      const unsigned char *p = c->pixels + y * pitch + rc->x * 3;
+      const unsigned char *q = a->prev + y * pitch + rc->x * 3;
+      if (!memcmp(p, q, n))
+        continue;
+      *y0 = y < *y0 ? y : *y0;
+      *y1 = y > *y1 ? y : *y1;
+      int l = 0, r = (int)n - 1;
+      while (p[l] == q[l])
+        l++;
+      while (p[r] == q[r])
+        r--;
+      if (rc->x + l / 3 < *x0)
+        *x0 = rc->x + l / 3;
+      if (rc->x + r / 3 > *x1)
+        *x1 = rc->x + r / 3;
+    }
+  }
+  return (*y1 >= 0);
+}
+
+/*
+
+GIF LZW. Codes start at min_size + 1 bits and grow when the next free code
+no longer fits; when the 4096 entry table is full a clear code starts over.
+Prefix + byte pairs are looked up in an open-addressing hash.
+
+*/
+
+#define PLT_LZW_SLOTS 8192
 
-    int n = x->shape[0];
-    for (int i = 0; i < n; i++) {
-      double xv = ndarray_get1d(x, i);
-      double yv = ndarray_get1d(y, i);
+typedef struct {
+  t_bytes *out;
+  unsigned char block[256]; // block[0] is the sub-block length
+  unsigned int bits;
+  int nbits;
+  int failed;
+} t_lzw_out;
+
+static void lzw_emit(t_lzw_out *w, int code, int size) {
+  w->bits |= (unsigned int)code << w->nbits;
+  w->nbits += size;
+  while (w->nbits >= 8) {
+    w->block[++w->block[0]] = (unsigned char)w->bits;
+    w->bits >>= 8;
+    w->nbits -= 8;
+    if (w->block[0] == 255) {
+      w->failed |= bytes_put(w->out, w->block, 256) < 0;
+      w->block[0] = 0;
+    }
+  }
+}
 
-      if (xv < lim.xmin)
-        lim.xmin = xv;
-      if (xv > lim.xmax)
-        lim.xmax = xv;
+static int gif_lzw(t_bytes *out, const unsigned char *idx, size_t n,
+                   int min_size) {
+  int *key = ft_malloc(sizeof(int) * PLT_LZW_SLOTS);
+  short *val = ft_malloc(sizeof(short) * PLT_LZW_SLOTS);
+  if (!key || !val) {
+    ft_free(key);
+    ft_free(val);
+    return (-1);
+  }
+  t_lzw_out w = {out, {0}, 0, 0, 0};
+  int clear = 1 << min_size, next = clear + 2, size = min_size + 1;
+  unsigned char ms = (unsigned char)min_size;
+  w.failed |= bytes_put(out, &ms, 1) < 0;
+  ft_memset(key, -1, sizeof(int) * PLT_LZW_SLOTS);
+  lzw_emit(&w, clear, size);
+  int prefix = idx[0];
+  for (size_t i = 1; i < n; i++) {
+    int k = prefix << 8 | idx[i];
+    unsigned int slot = ((unsigned int)k * 2654435761u) >> 19;
+    while (key[slot] >= 0 && key[slot] != k)
+      slot = (slot + 1) & (PLT_LZW_SLOTS - 1);
+    if (key[slot] == k) {
+      prefix = val[slot];
+      continue;
+    }
+    lzw_emit(&w, prefix, size);
+    if (next < 4096) {
+      key[slot] = k;
+      val[slot] = (short)next++;
+      if (next > (1 << size) && size < 12)
+        size++;
+    } else {
+      lzw_emit(&w, clear, size);
+      ft_memset(key, -1, sizeof(int) * PLT_LZW_SLOTS);
+      next = clear + 2;
+      size = min_size + 1;
+    }
+    prefix = idx[i];
+  }
+  lzw_emit(&w, prefix, size);
+  lzw_emit(&w, clear + 1, size);
+  if (w.nbits > 0)
+    lzw_emit(&w, 0, 8 - w.nbits);
+  if (w.block[0])
+    w.failed |= bytes_put(out, w.block, w.block[0] + 1) < 0;
+  unsigned char end = 0;
+  w.failed |= bytes_put(out, &end, 1) < 0;
+  ft_free(key);
+  ft_free(val);
+  return (w.failed ? -1 : 0);
+}
 
-      if (yv < lim.ymin)
-        lim.ymin = yv;
-      if (yv > lim.ymax)
-        lim.ymax = yv;
+static int anim_encode_gif(Animation *a, const Canvas *c, t_png_scratch *sc) {
+  const unsigned char *rows = c->pixels + ((size_t)a->py * a->width + a->px) *
+                                              3;
+  int pitch = a->width * 3;
+  t_bytes *idx = &sc->index;
+  idx->len = 0;
+  if (bytes_reserve(idx, (size_t)a->pw * a->ph) < 0)
+    return (-1);
+  unsigned char pal[256 * 3];
+  int npal = 0;
+  if (palette_index(rows, a->pw, a->ph, pitch, pal, &npal, idx->data) < 0) {
+    for (int i = 0; i < 216; i++) {
+      pal[3 * i] = (unsigned char)(i / 36 * 51);
+      pal[3 * i + 1] = (unsigned char)(i / 6 % 6 * 51);
+      pal[3 * i + 2] = (unsigned char)(i % 6 * 51);
+    }
+    npal = 216;
+    size_t k = 0;
+    for (int y = 0; y < a->ph; y++) {
+      const unsigned char *p = rows + (size_t)y * pitch;
+      for (int x = 0; x < a->pw; x++, p += 3)
+        idx->data[k++] = (unsigned char)((p[0] * 5 + 127) / 255 * 36 +
+                                         (p[1] * 5 + 127) / 255 * 6 +
+                                         (p[2] * 5 + 127) / 255);
     }
   }
+  int depth = 1;
+  while ((1 << depth) < npal)
+    depth++;
+  unsigned char desc[10] = {0x2C};
+  put_le16(desc + 1, (unsigned int)a->px);
+  put_le16(desc + 3, (unsigned int)a->py);
+  put_le16(desc + 5, (unsigned int)a->pw);
+  put_le16(desc + 7, (unsigned int)a->ph);
+  desc[9] = (unsigned char)(0x80 | (depth - 1)); // local color table
+  t_bytes *d = &a->pdata;
+  if (bytes_put(d, desc, 10) < 0 || bytes_reserve(d, (size_t)3 << depth) < 0)
+    return (-1);
+  ft_memset(d->data + d->len, 0, (size_t)3 << depth);
+  ft_memcpy(d->data + d->len, pal, (size_t)npal * 3);
+  d->len += (size_t)3 << depth;
+  return (gif_lzw(d, idx->data, (size_t)a->pw * a->ph, depth < 2 ? 2 : depth));
+}
 
-  // 5% margin
+static int anim_encode_png(Animation *a, const Canvas *c, t_png_scratch *sc) {
+  pthread_once(&g_png_tables_once, png_tables_init);
+  int pitch = a->width * 3;
+  t_png_image img = {c->pixels + (size_t)a->py * pitch + (size_t)a->px * 3,
+                     a->pw, a->ph, a->pw * 3, pitch, 3, 8, 2};
+  t_png_band *b = &sc->band[0];
+  if (png_band_filter(b, &img, 0, img.height, a->opts.filter) < 0)
+    return (-1);
+  int zlen = 0;
+  unsigned char *z;
+  if (a->opts.level <= 0 && !a->opts.deflate)
+    z = zlib_wrap(b->raw.data, (int)b->raw_len, &zlen, 0);
+  else
+    z = deflate_backend(&a->opts)(b->raw.data, (int)b->raw_len, &zlen,
+                                  a->opts.level);
+  if (!z)
+    return (-1);
+  int ret = bytes_put(&a->pdata, z, (size_t)zlen);
+  STBIW_FREE(z);
+  return (ret);
+}
+
+// appends the pending frame, now that its delay is known, to a->out
+static void anim_flush_frame(Animation *a) {
+  if (!a->pending)
+    return;
+  t_sink out = {&a->out, NULL, NULL, 0, 0};
+  if (a->format == PLT_ANIM_GIF) {
+    unsigned char gce[8] = {0x21, 0xF9, 4, 1 << 2, 0, 0, 0, 0};
+    put_le16(gce + 4, (unsigned int)((a->pdelay + 5) / 10));
+    sink_put(&out, gce, 8);
+    sink_put(&out, a->pdata.data, a->pdata.len);
+  } else {
+    unsigned char fc[26];
+    put_be32(fc, a->seq++);
+    put_be32(fc + 4, (unsigned int)a->pw);
+    put_be32(fc + 8, (unsigned int)a->ph);
+    put_be32(fc + 12, (unsigned int)a->px);
+    put_be32(fc + 16, (unsigned int)a->py);
+    int num = a->pdelay, den = 1000;
+    while (num > 65535) {
+      num /= 10;
+      den /= 10;
+    }
+    fc[20] = (unsigned char)(num >> 8);
+    fc[21] = (unsigned char)num;
+    fc[22] = (unsigned char)(den >> 8);
+    fc[23] = (unsigned char)den;
+    fc[24] = 0; // dispose NONE
+    fc[25] = 0; // blend SOURCE
+    png_chunk(&out, "fcTL", fc, 26);
+    if (a->nframes == 0) {
+      png_chunk(&out, "IDAT", a->pdata.data, a->pdata.len);
+    } else {
+      unsigned char hdr[12];
+      put_be32(hdr, (unsigned int)a->pdata.len + 4);
+      ft_memcpy(hdr + 4, "fdAT", 4);
+      put_be32(hdr + 8, a->seq++);
+      unsigned char crc[4];
+      put_be32(crc, crc_update(crc_update(0, hdr + 4, 8), a->pdata.data,
+                               a->pdata.len));
+      sink_put(&out, hdr, 12);
+      sink_put(&out, a->pdata.data, a->pdata.len);
+      sink_put(&out, crc, 4);
+    }
+  }
+  a->failed |= out.failed;
+  a->nframes++;
+  a->pending = 0;
+}
+
+static void anim_write_out(Animation *a) {
+  struct iovec iov[1] = {{a->out.data, a->out.len}};
+  if (a->out.len && writev_all(a->fd, iov, 1) < 0)
+    a->failed = 1;
+  a->out.len = 0;
+}
+
+Animation *plt_anim_open(const char *filename, int w, int h, int format,
+                         int loops) {
+  if (!filename || w <= 0 || h <= 0) {
+    ft_printf("Error: plt_anim_open invalid arguments\n");
+    return (NULL);
+  }
+  if (format == PLT_ANIM_AUTO)
+    format = has_ext(filename, ".gif") ? PLT_ANIM_GIF : PLT_ANIM_APNG;
+  Animation *a = ft_calloc(1, sizeof(Animation));
+  if (!a)
+    return (NULL);
+  a->prev = ft_malloc((size_t)w * h * 3);
+  a->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (!a->prev || a->fd < 0) {
+    ft_printf("Error: plt_anim_open cannot open %s\n", filename);
+    if (a->fd >= 0)
+      close(a->fd);
+    ft_free(a->prev);
+    ft_free(a);
+    return (NULL);
+  }
+  a->format = format;
+  a->width = w;
+  a->height = h;
+  a->loops = loops;
+  a->opts = plt_save_options();
+  t_sink out = {&a->out, NULL, NULL, 0, 0};
+  if (format == PLT_ANIM_GIF) {
+    unsigned char hdr[13] = {'G', 'I', 'F', '8', '9', 'a'};
+    put_le16(hdr + 6, (unsigned int)w);
+    put_le16(hdr + 8, (unsigned int)h);
+    sink_put(&out, hdr, 13); // no global color table
+    unsigned char loop[19] = {0x21, 0xFF, 11,  'N', 'E', 'T', 'S',
+                              'C',  'A',  'P', 'E', '2', '.', '0',
+                              3,    1,    0,   0,   0};
+    put_le16(loop + 16, (unsigned int)loops);
+    sink_put(&out, loop, 19);
+  } else {
+    pthread_once(&g_png_tables_once, png_tables_init);
+    png_header(&out, w, h, 8, 2);
+    unsigned char actl[8];
+    put_be32(actl, 0); // frame count, patched by plt_anim_close
+    put_be32(actl + 4, (unsigned int)loops);
+    png_chunk(&out, "acTL", actl, 8);
+  }
+  a->failed = out.failed;
+  anim_write_out(a);
+  return (a);
+}
+
+int plt_anim_frame(Animation *a, Canvas *c, int delay_ms) {
+  if (!a || !c || c->width != a->width || c->height != a->height) {
+    ft_printf("Error: plt_anim_frame canvas does not match the animation\n");
+    return (-1);
+  }
+  int x0 = 0, y0 = 0, x1 = a->width - 1, y1 = a->height - 1;
+  if (a->pending || a->nframes) {
+    if (!anim_diff(a, c, &x0, &y0, &x1, &y1)) {
+      a->pdelay += delay_ms;
+      return (0);
+    }
+  }
+  anim_flush_frame(a);
+  anim_write_out(a);
+  t_png_scratch *sc = png_scratch(&a->work);
+  if (!sc)
+    return (-1);
+  a->px = x0;
+  a->py = y0;
+  a->pw = x1 - x0 + 1;
+  a->ph = y1 - y0 + 1;
+  a->pdelay = delay_ms;
+  a->pdata.len = 0;
+  int ret = a->format == PLT_ANIM_GIF ? anim_encode_gif(a, c, sc)
+                                      : anim_encode_png(a, c, sc);
+  if (ret < 0) {
+    ft_printf("Error: plt_anim_frame encoding failed\n");
+    a->failed = 1;
+    return (-1);
+  }
+  a->pending = 1;
+  size_t pitch = (size_t)a->width * 3;
+  for (int y = y0; y <= y1; y++)
+    ft_memcpy(a->prev + y * pitch + x0 * 3, c->pixels + y * pitch + x0 * 3,
+              (size_t)a->pw * 3);
+  return (0);
+}
+
+int plt_anim_close(Animation *a) {
+  if (!a)
+    return (-1);
+  anim_flush_frame(a);
+  t_sink out = {&a->out, NULL, NULL, 0, 0};
+  if (a->format == PLT_ANIM_GIF) {
+    unsigned char trailer = 0x3B;
+    sink_put(&out, &trailer, 1);
+  } else {
+    png_chunk(&out, "IEND", NULL, 0);
+  }
+  a->failed |= out.failed;
+  anim_write_out(a);
+  if (a->format == PLT_ANIM_APNG) {
+    // acTL sits right after the signature and IHDR
+    unsigned char actl[16];
+    ft_memcpy(actl, "acTL", 4);
+    put_be32(actl + 4, (unsigned int)a->nframes);
+    put_be32(actl + 8, (unsigned int)a->loops);
+    put_be32(actl + 12, crc_update(0, actl, 12));
+    if (pwrite(a->fd, actl + 4, 12, 8 + 25 + 8) != 12)
+      a->failed = 1;
+  }
+  if (close(a->fd) < 0)
+    a->failed = 1;
+  int ret = a->failed ? -1 : 0;
+  if (ret < 0)
+    ft_printf("Error: plt_anim_close: writing the animation failed\n");
+  plt_buffer_free(&a->work);
+  STBIW_FREE(a->out.data);
+  STBIW_FREE(a->pdata.data);
+  ft_free(a->prev);
+  ft_free(a);
+  return (ret);
+}
+
+/*
+
+Raw video streams.
+
+Frames go out back to back with no header, which is what ffmpeg's rawvideo
+demuxer expects. rgb24 frames are written straight from Canvas.pixels;
+rgba frames are expanded a band of rows at a time into a small buffer that is
+kept for the life of the stream.
+
+*/
+
+#define PLT_STREAM_CHUNK (1 << 18) // bytes of rgba staged per write
+
+struct s_stream {
+  int fd;
+  int width;
+  int height;
+  int format;
+  unsigned char *buf; // rgba staging, NULL for rgb24
+  int band;           // rows per rgba write
+  long frames;
+};
+
+Stream *plt_stream_open(int fd, int w, int h, int format) {
+  if (fd < 0 || w <= 0 || h <= 0 ||
+      (format != PLT_STREAM_RGB24 && format != PLT_STREAM_RGBA)) {
+    ft_printf("Error: plt_stream_open: invalid arguments\n");
+    return (NULL);
+  }
+  Stream *s = ft_calloc(1, sizeof(Stream));
+  if (!s) {
+    ft_printf("Error: plt_stream_open: out of memory\n");
+    return (NULL);
+  }
+  s->fd = fd;
+  s->width = w;
+  s->height = h;
+  s->format = format;
+  if (format == PLT_STREAM_RGBA) {
+    s->band = PLT_STREAM_CHUNK / (w * 4);
+    if (s->band < 1)
+      s->band = 1;
+    if (s->band > h)
+      s->band = h;
+    s->buf = ft_malloc((size_t)s->band * w * 4);
+    if (!s->buf) {
+      ft_printf("Error: plt_stream_open: out of memory\n");
+      ft_free(s);
+      return (NULL);
+    }
+  }
+  return (s);
+}
+
+static int stream_write_rgba(Stream *s, const unsigned char *p) {
+  for (int y = 0; y < s->height; y += s->band) {
+    int rows = s->height - y < s->band ? s->height - y : s->band;
+    size_t n = (size_t)rows * s->width;
+    unsigned char *q = s->buf;
+    for (size_t i = 0; i < n; i++, p += 3, q += 4) {
+      q[0] = p[0];
+      q[1] = p[1];
+      q[2] = p[2];
+      q[3] = 255;
+    }
+    struct iovec iov = {s->buf, n * 4};
+    if (writev_all(s->fd, &iov, 1) < 0)
+      return (-1);
+  }
+  return (0);
+}
+
+int plt_stream_write(Stream *s, const Canvas *c) {
+  if (!s || !c || !c->pixels) {
+    ft_printf("Error: plt_stream_write: invalid arguments\n");
+    return (-1);
+  }
+  if (c->width != s->width || c->height != s->height) {
+    ft_printf("Error: plt_stream_write: canvas is %dx%d, stream is %dx%d\n",
+              c->width, c->height, s->width, s->height);
+    return (-1);
+  }
+  int ret;
+  if (s->format == PLT_STREAM_RGBA)
+    ret = stream_write_rgba(s, c->pixels);
+  else {
+    struct iovec iov = {c->pixels, (size_t)c->width * c->height * 3};
+    ret = writev_all(s->fd, &iov, 1);
+  }
+  if (ret < 0) {
+    ft_printf("Error: plt_stream_write: write failed after %ld frames\n",
+              s->frames);
+    return (-1);
+  }
+  s->frames++;
+  return (0);
+}
+
+long plt_stream_close(Stream *s) {
+  if (!s)
+    return (-1);
+  long frames = s->frames;
+  ft_free(s->buf);
+  ft_free(s);
+  return (frames);
+}
+
+void plt_savefig(Canvas *c, const char *filename) {
+  stbi_write_png(filename, c->width, c->height, 3, c->pixels, c->width * 3);
+}
+
+// reduction results per axis, keeping fallback where an axis had no numbers
+static AxisLimits axis_limits_from(const double lo[2], const double hi[2],
+                                   AxisLimits fallback) {
+  AxisLimits lim = fallback;
+  if (lo[0] <= hi[0]) {
+    lim.xmin = lo[0];
+    lim.xmax = hi[0];
+  }
+  if (lo[1] <= hi[1]) {
+    lim.ymin = lo[1];
+    lim.ymax = hi[1];
+  }
+  return (lim);
+}
+
+static AxisLimits axis_limits_margin(AxisLimits lim) {
   double xmargin = (lim.xmax - lim.xmin) * 0.05;
   double ymargin = (lim.ymax - lim.ymin) * 0.05;
 
+  // Avoid degenerate axes (all values the same)
   if (xmargin == 0)
     xmargin = 1.0;
   if (ymargin == 0)
@@ -669,6 +5037,679 @@ AxisLimits plt_axis_auto_multi(ndarray **xs, ndarray **ys, int nplots) {
   lim.xmax += xmargin;
   lim.ymin -= ymargin;
   lim.ymax += ymargin;
-
   return (lim);
 }
+
+AxisLimits plt_axis_auto(ndarray *x, ndarray *y) {
+  // Default axis limits (safe fallback)
+  AxisLimits lim = {0, 1, 0, 1};
+
+  // 1. Validate pointers
+  if (!x || !y) {
+    ft_printf("Error: plt_axis_auto received NULL pointer (x or y)\n");
+    return (lim);
+  }
+
+  // 2. Validate dimensions (we only handle 1D arrays here)
+  if (x->ndim != 1 || y->ndim != 1) {
+    ft_printf("Error: plt_axis_auto supports only 1D arrays\n");
+    return (lim);
+  }
+
+  // 3. Validate size
+  if (x->shape[0] <= 0 || y->shape[0] <= 0) {
+    ft_printf("Error: empty arrays passed to plt_axis_auto\n");
+    return (lim);
+  }
+
+  // 4. Handle mismatch between x and y sizes
+  if (x->shape[0] != y->shape[0]) {
+    ft_printf(
+        "Warning: x and y sizes differ (%d vs %d). Using the smaller one.\n",
+        x->shape[0], y->shape[0]);
+  }
+
+  long n = (x->shape[0] < y->shape[0]) ? x->shape[0] : y->shape[0];
+
+  // 5. Vectorised min/max of both axes, NaNs skipped
+  const double *v[2] = {(const double *)x->data, (const double *)y->data};
+  long len[2] = {n, n};
+  int axis[2] = {0, 1};
+  double lo[2], hi[2];
+  long nans[2];
+  minmax_reduce(v, len, axis, 2, lo, hi, nans);
+
+  // 6. An axis with no numbers at all keeps the fallback range
+  lim = axis_limits_from(lo, hi, lim);
+
+  // 7. Add 5% margin around the data (like matplotlib)
+  return (axis_limits_margin(lim));
+}
+
+AxisLimits plt_axis_auto_multi(ndarray **xs, ndarray **ys, int nplots) {
+  AxisLimits lim = {0, 1, 0, 1};
+  if (!xs || !ys || nplots <= 0)
+    return (axis_limits_margin(lim));
+
+  // every series is one reduction job; big ones are split further
+  const double **v = ft_malloc(sizeof(double *) * 2 * nplots);
+  long *len = ft_malloc(sizeof(long) * 2 * nplots);
+  int *axis = ft_malloc(sizeof(int) * 2 * nplots);
+  if (!v || !len || !axis) {
+    ft_free(v);
+    ft_free(len);
+    ft_free(axis);
+    return (axis_limits_margin(lim));
+  }
+  for (int p = 0; p < nplots; p++) {
+    ndarray *a[2] = {xs[p], ys[p]};
+    for (int k = 0; k < 2; k++) {
+      v[2 * p + k] = a[k] ? (const double *)a[k]->data : NULL;
+      len[2 * p + k] = a[k] ? a[k]->shape[0] : 0;
+      axis[2 * p + k] = k;
+    }
+  }
+  double lo[2], hi[2];
+  long nans[2];
+  minmax_reduce(v, len, axis, 2 * nplots, lo, hi, nans);
+  ft_free(v);
+  ft_free(len);
+  ft_free(axis);
+
+  // 5% margin
+  return (axis_limits_margin(axis_limits_from(lo, hi, lim)));
+}
+
+/*
+
+Series handles.
+
+A Series wraps an x/y pair and caches per-axis statistics (min, max, NaN
+count, sortedness) plus, on request, a min/max pyramid of y for level of
+detail. Everything is computed on first use. plt_series_set writes through
+the handle and keeps the cache valid where it can: a new extreme just moves
+min or max, a value that stays between its neighbours keeps x sorted, and
+the pyramid is refreshed along the one path from the changed point to the
+top. Only overwriting the current min or max, or breaking an unknown
+ordering, drops that statistic for a later rescan.
+
+*/
+
+#define PLT_LOD_BASE 3 // level 0 blocks hold 8 points
+
+static void series_axis(Series *s, int axis, const double **v) {
+  ndarray *a = axis ? s->y : s->x;
+  *v = (const double *)a->data;
+}
+
+static void series_compute_range(Series *s, int axis) {
+  const double *v;
+  series_axis(s, axis, &v);
+  double lo[2], hi[2];
+  long nans[2];
+  int ax = 0;
+  minmax_reduce(&v, &s->n, &ax, 1, lo, hi, nans);
+  SeriesStats *st = axis ? &s->ystats : &s->xstats;
+  st->min = lo[0];
+  st->max = hi[0];
+  st->nans = nans[0];
+  st->valid |= PLT_STAT_RANGE;
+}
+
+static void series_compute_sorted(Series *s, int axis) {
+  const double *v;
+  series_axis(s, axis, &v);
+  int sorted = s->n == 0 || v[0] == v[0];
+  for (long i = 1; i < s->n && sorted; i++)
+    sorted = v[i] >= v[i - 1]; // false for NaN as well
+  SeriesStats *st = axis ? &s->ystats : &s->xstats;
+  st->sorted = sorted;
+  st->valid |= PLT_STAT_SORTED;
+}
+
+const SeriesStats *plt_series_stats(Series *s, int axis) {
+  SeriesStats *st = axis ? &s->ystats : &s->xstats;
+  if (!(st->valid & PLT_STAT_RANGE))
+    series_compute_range(s, axis);
+  if (!(st->valid & PLT_STAT_SORTED))
+    series_compute_sorted(s, axis);
+  return (st);
+}
+
+// recomputes pyramid block b of level k from the data or from level k - 1;
+// a block holding a NaN gets a NaN min, so the plot knows the line breaks
+static void series_lod_block(Series *s, int k, long b) {
+  double lo = 1.0 / 0.0, hi = -1.0 / 0.0;
+  int nan = 0;
+  if (k == 0) {
+    const double *y = (const double *)s->y->data;
+    long i0 = b << PLT_LOD_BASE;
+    long i1 = i0 + (1L << PLT_LOD_BASE);
+    if (i1 > s->n)
+      i1 = s->n;
+    for (long i = i0; i < i1; i++) {
+      lo = y[i] < lo ? y[i] : lo;
+      hi = y[i] > hi ? y[i] : hi;
+      nan |= y[i] != y[i];
+    }
+  } else {
+    long nchild = s->lod_len[k - 1];
+    for (long c = 2 * b; c < 2 * b + 2 && c < nchild; c++) {
+      double cl = s->lod_min[k - 1][c];
+      lo = cl < lo ? cl : lo;
+      hi = s->lod_max[k - 1][c] > hi ? s->lod_max[k - 1][c] : hi;
+      nan |= cl != cl;
+    }
+  }
+  s->lod_min[k][b] = nan ? 0.0 / 0.0 : lo;
+  s->lod_max[k][b] = hi;
+}
+
+static void series_lod_free(Series *s) {
+  for (int k = 0; k < s->lod_levels; k++) {
+    ft_free(s->lod_min[k]);
+    ft_free(s->lod_max[k]);
+  }
+  s->lod_levels = 0;
+  s->lod_valid = 0;
+}
+
+static void series_lod_build(Series *s) {
+  series_lod_free(s);
+  long len = (s->n + (1L << PLT_LOD_BASE) - 1) >> PLT_LOD_BASE;
+  while (len > 1 && s->lod_levels < PLT_LOD_MAX_LEVELS) {
+    int k = s->lod_levels;
+    s->lod_min[k] = ft_malloc(sizeof(double) * len);
+    s->lod_max[k] = ft_malloc(sizeof(double) * len);
+    if (!s->lod_min[k] || !s->lod_max[k]) {
+      ft_free(s->lod_min[k]);
+      ft_free(s->lod_max[k]);
+      break;
+    }
+    s->lod_len[k] = len;
+    s->lod_levels++;
+    for (long b = 0; b < len; b++)
+      series_lod_block(s, k, b);
+    len = (len + 1) / 2;
+  }
+  s->lod_valid = 1;
+}
+
+Series *plt_series_create(ndarray *x, ndarray *y) {
+  if (!x || !y || !x->data || !y->data) {
+    ft_printf("Error: plt_series_create received NULL array/data\n");
+    return (NULL);
+  }
+  Series *s = ft_calloc(1, sizeof(Series));
+  if (!s)
+    return (NULL);
+  s->x = x;
+  s->y = y;
+  s->n = (x->shape[0] < y->shape[0]) ? x->shape[0] : y->shape[0];
+  return (s);
+}
+
+void plt_series_destroy(Series *s) {
+  if (!s)
+    return;
+  series_lod_free(s);
+  ft_free(s);
+}
+
+void plt_series_enable_lod(Series *s, int on) {
+  s->lod_enabled = on;
+  if (!on)
+    series_lod_free(s);
+}
+
+void plt_series_invalidate(Series *s) {
+  s->n = (s->x->shape[0] < s->y->shape[0]) ? s->x->shape[0] : s->y->shape[0];
+  s->xstats.valid = 0;
+  s->ystats.valid = 0;
+  s->lod_valid = 0;
+}
+
+static void series_update_axis(Series *s, int axis, long i, double old,
+                               double val) {
+  SeriesStats *st = axis ? &s->ystats : &s->xstats;
+  const double *v;
+  series_axis(s, axis, &v);
+
+  if (st->valid & PLT_STAT_RANGE) {
+    st->nans += (val != val) - (old != old);
+    if ((old == st->min && !(val <= old)) ||
+        (old == st->max && !(val >= old))) {
+      st->valid &= ~PLT_STAT_RANGE; // an extreme went away
+    } else {
+      st->min = val < st->min ? val : st->min;
+      st->max = val > st->max ? val : st->max;
+    }
+  }
+  if (st->valid & PLT_STAT_SORTED) {
+    int fits = val == val && (i == 0 || val >= v[i - 1]) &&
+               (i + 1 >= s->n || val <= v[i + 1]);
+    if (st->sorted && !fits)
+      st->sorted = 0;
+    else if (!st->sorted)
+      st->valid &= ~PLT_STAT_SORTED; // this write may have fixed the order
+  }
+}
+
+void plt_series_set(Series *s, long i, double xv, double yv) {
+  if (!s || i < 0 || i >= s->n)
+    return;
+  double *x = (double *)s->x->data;
+  double *y = (double *)s->y->data;
+  double ox = x[i], oy = y[i];
+  x[i] = xv;
+  y[i] = yv;
+  series_update_axis(s, 0, i, ox, xv);
+  series_update_axis(s, 1, i, oy, yv);
+  if (s->lod_valid) {
+    long b = i >> PLT_LOD_BASE;
+    for (int k = 0; k < s->lod_levels; k++, b >>= 1)
+      series_lod_block(s, k, b);
+  }
+}
+
+AxisLimits plt_series_limits(Series **series, int nseries) {
+  AxisLimits lim = {0, 1, 0, 1};
+  double lo[2] = {1.0 / 0.0, 1.0 / 0.0}, hi[2] = {-1.0 / 0.0, -1.0 / 0.0};
+  for (int p = 0; p < nseries; p++) {
+    if (!series[p])
+      continue;
+    for (int axis = 0; axis < 2; axis++) {
+      SeriesStats *st = axis ? &series[p]->ystats : &series[p]->xstats;
+      if (!(st->valid & PLT_STAT_RANGE))
+        series_compute_range(series[p], axis);
+      lo[axis] = st->min < lo[axis] ? st->min : lo[axis];
+      hi[axis] = st->max > hi[axis] ? st->max : hi[axis];
+    }
+  }
+  return (axis_limits_margin(axis_limits_from(lo, hi, lim)));
+}
+
+// first index in [0, n) with v[i] >= key (v sorted)
+static long series_lower_bound(const double *v, long n, double key) {
+  long lo = 0, hi = n;
+  while (lo < hi) {
+    long mid = lo + (hi - lo) / 2;
+    if (v[mid] < key)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return (lo);
+}
+
+/*
+
+Plots a series. With sorted x only the visible index range (plus one point
+on each side for the segments that enter and leave) is drawn. With LOD on
+and more than four points per pixel column, whole pyramid blocks of at most
+half a column are drawn as first, min, max and last vertex (M4), which the
+polyline run compressor turns into one span per column; partial blocks at
+the edges use the raw points. A NaN in x or y breaks the line: a block
+holding a NaN is split into its children down to the raw points around the
+NaN, so the gap is the same with and without LOD.
+
+*/
+
+static inline int series_px(const Canvas *c, AxisLimits lim, double v) {
+  return ((int)((v - lim.xmin) / (lim.xmax - lim.xmin) * (c->width - 1)));
+}
+
+static inline int series_py(const Canvas *c, AxisLimits lim, double v) {
+  double t = (v - lim.ymin) / (lim.ymax - lim.ymin);
+  return ((int)((1 - t) * (c->height - 1)));
+}
+
+// adds one vertex; a NaN ends the current line, as in matplotlib
+static inline void series_vertex(t_polyrun *pr, t_dl_poly *rec,
+                                 AxisLimits lim, double xv, double yv) {
+  dl_poly_push(rec, xv, yv);
+  if (xv != xv || yv != yv) {
+    polyrun_end(pr);
+    polyrun_begin(pr, pr->c, pr->col);
+    return;
+  }
+  polyrun_push(pr, series_px(pr->c, lim, xv), series_py(pr->c, lim, yv));
+}
+
+// block b of pyramid level k as M4 vertices, or split where it holds a NaN
+static void series_lod_draw(t_polyrun *pr, t_dl_poly *rec, AxisLimits lim,
+                            Series *s, int k, long b) {
+  const double *x = (const double *)s->x->data;
+  const double *y = (const double *)s->y->data;
+  long first = b << (k + PLT_LOD_BASE);
+  long last = first + (1L << (k + PLT_LOD_BASE)) - 1;
+  double lo = s->lod_min[k][b];
+  if (lo != lo) {
+    if (k > 0) {
+      series_lod_draw(pr, rec, lim, s, k - 1, 2 * b);
+      series_lod_draw(pr, rec, lim, s, k - 1, 2 * b + 1);
+    } else {
+      for (long i = first; i <= last; i++)
+        series_vertex(pr, rec, lim, x[i], y[i]);
+    }
+    return;
+  }
+  series_vertex(pr, rec, lim, x[first], y[first]);
+  series_vertex(pr, rec, lim, x[first], lo);
+  series_vertex(pr, rec, lim, x[first], s->lod_max[k][b]);
+  series_vertex(pr, rec, lim, x[last], y[last]);
+}
+
+// coarsest pyramid level whose blocks cover at most half a column, or -1
+static int series_lod_level(Series *s, const Canvas *c, long count) {
+  if (!s->lod_enabled || count <= 4L * c->width)
+    return (-1);
+  if (!s->lod_valid)
+    series_lod_build(s);
+  double per_col = (double)count / c->width;
+  int level = -1;
+  for (int k = 0; k < s->lod_levels; k++)
+    if ((double)(1L << (k + PLT_LOD_BASE)) <= per_col / 2)
+      level = k;
+  return (level);
+}
+
+void plt_series_plot(Canvas *c, Series *s, Color col, AxisLimits lim) {
+  if (!s || s->n < 2)
+    return;
+  const double *x = (const double *)s->x->data;
+  const double *y = (const double *)s->y->data;
+  const SeriesStats *xs = plt_series_stats(s, 0);
+  long i0 = 0, i1 = s->n - 1;
+  int level = -1;
+  if (xs->sorted) {
+    // (int) truncates toward zero: up to a pixel left of xmin lands on 0
+    double pix = (lim.xmax - lim.xmin) / (c->width - 1);
+    i0 = series_lower_bound(x, s->n, lim.xmin - pix) - 1;
+    i1 = series_lower_bound(x, s->n, lim.xmax + pix);
+    i0 = i0 < 0 ? 0 : i0;
+    i1 = i1 >= s->n ? s->n - 1 : i1;
+    level = series_lod_level(s, c, i1 - i0 + 1);
+  }
+
+  t_polyrun pr;
+  t_dl_poly rec;
+  polyrun_begin(&pr, c, col);
+  dl_poly_begin(&rec, c, PLT_DL_LINE, col, 0, lim);
+  long i = i0;
+  if (level >= 0) {
+    long bsize = 1L << (level + PLT_LOD_BASE);
+    long b0 = (i0 + bsize - 1) / bsize;
+    long b1 = (i1 + 1) / bsize; // exclusive
+    for (; i < b0 * bsize && i <= i1; i++)
+      series_vertex(&pr, &rec, lim, x[i], y[i]);
+    for (long b = b0; b < b1; b++)
+      series_lod_draw(&pr, &rec, lim, s, level, b);
+    if (b1 > b0)
+      i = b1 * bsize;
+  }
+  for (; i <= i1; i++)
+    series_vertex(&pr, &rec, lim, x[i], y[i]);
+  polyrun_end(&pr);
+  dl_poly_end(&rec);
+}
+
+/*
+
+Display list replay and files.
+
+Replay runs every command through the same drawing code as the original
+call, with the target canvas's size, so text stays centred and data maps to
+the new pixel grid. A file is a 16-byte header ("PLTD", version, payload
+length, all native byte order) followed by the command buffer; loading checks
+every command before the list can be replayed: its framing, and that its
+arguments, limits and vertices are finite and small enough that no drawing
+loop can run away on a corrupt or crafted file.
+
+*/
+
+#define PLT_DL_VERSION 1
+
+static void dl_replay_cmd(Canvas *c, const t_dl_cmd *cmd) {
+  const double *v = (const double *)(cmd + 1);
+  const char *text = (const char *)(cmd + 1);
+  AxisLimits lim = cmd->lim;
+  t_dl_poly rec;
+  if (cmd->type == PLT_DL_LINE) {
+    t_polyrun pr;
+    polyrun_begin(&pr, c, cmd->col);
+    dl_poly_begin(&rec, c, PLT_DL_LINE, cmd->col, 0, lim);
+    for (long i = 0; i < cmd->n; i++)
+      series_vertex(&pr, &rec, lim, v[2 * i], v[2 * i + 1]);
+    polyrun_end(&pr);
+    dl_poly_end(&rec);
+  } else if (cmd->type == PLT_DL_MARKERS) {
+    dl_poly_begin(&rec, c, PLT_DL_MARKERS, cmd->col, cmd->arg, lim);
+    for (long i = 0; i < cmd->n; i++) {
+      int px = series_px(c, lim, v[2 * i]);
+      int py = series_py(c, lim, v[2 * i + 1]);
+      if (cmd->arg < 0)
+        draw_rect(c, px - 1, py - 1, 3, 3, cmd->col);
+      else
+        draw_circle(c, px, py, cmd->arg, cmd->col);
+      dl_marker_push(&rec, v[2 * i], v[2 * i + 1], px, py);
+    }
+    dl_poly_end(&rec);
+  } else if (cmd->type == PLT_DL_TITLE)
+    plt_title(c, text, cmd->col);
+  else if (cmd->type == PLT_DL_XLABEL)
+    plt_xlabel(c, text, cmd->col);
+  else if (cmd->type == PLT_DL_YLABEL)
+    plt_ylabel(c, text, cmd->col);
+  else if (cmd->type == PLT_DL_LEGEND_ITEM) {
+    dl_text(c, PLT_DL_LEGEND_ITEM, text, cmd->col, cmd->arg, lim);
+    legend_item(c, cmd->arg, text, cmd->col);
+  } else if (cmd->type == PLT_DL_LEGEND_TEXT)
+    plt_legend(c, text, (int)floor(lim.xmin * c->width + 0.5),
+               (int)floor(lim.ymin * c->height + 0.5), cmd->col);
+  else if (cmd->type == PLT_DL_DRAW_AXES)
+    draw_axes(c, lim.xmin, lim.xmax, lim.ymin, lim.ymax);
+  else if (cmd->type == PLT_DL_AXES)
+    plt_axes(c, cmd->col);
+  else if (cmd->type == PLT_DL_AXES2)
+    plt_axes2(c, lim, cmd->col, cmd->arg);
+}
+
+static void dl_replay_all(const DisplayList *dl, Canvas *c) {
+  for (size_t off = 0; off < dl->buf.len;) {
+    const t_dl_cmd *cmd = (const t_dl_cmd *)(dl->buf.data + off);
+    dl_replay_cmd(c, cmd);
+    off += cmd->size;
+  }
+}
+
+/*
+
+Banded replay.
+
+Each worker replays the whole list onto a copy of the canvas whose clip rows
+are its own band, so every primitive still walks exactly the pixels it
+would walk serially but only writes the rows it owns. Bands never share a
+row, so no locks are needed and the result is byte-identical to a serial
+replay. Primitives lying wholly outside a band are rejected on their y
+range before any per-pixel work, which is what makes the bands cheap.
+Damage is collected per band and merged after the join. A recording canvas
+replays serially, since its list must be appended once and in order.
+
+*/
+
+#define PLT_RASTER_GRAIN (1L << 18) // pixels per band worker
+
+typedef struct {
+  const DisplayList *dl;
+  Canvas *c;
+  int top;
+  Damage damage[PLT_MAX_THREADS];
+} t_band_replay;
+
+static void band_replay_task(void *arg, int tid, long start, long end) {
+  t_band_replay *br = arg;
+  Canvas band = *br->c;
+  br->damage[tid].nrects = 0;
+  band.damage = br->c->damage ? &br->damage[tid] : NULL;
+  band.clip_y0 = br->top + (int)start;
+  band.clip_y1 = br->top + (int)end;
+  dl_replay_all(br->dl, &band);
+}
+
+int plt_displaylist_replay(const DisplayList *dl, Canvas *c) {
+  if (!dl || !c || !c->pixels) {
+    ft_printf("Error: plt_displaylist_replay: invalid arguments\n");
+    return (-1);
+  }
+  if (dl->failed) {
+    ft_printf("Error: plt_displaylist_replay: the list is incomplete\n");
+    return (-1);
+  }
+  if (c->record == dl) {
+    ft_printf("Error: plt_displaylist_replay: canvas is recording this list\n");
+    return (-1);
+  }
+  int top = clip_top(c), rows = clip_bottom(c) - top;
+  int nw = c->record ? 1 : parallel_workers((long)c->width * rows,
+                                            PLT_RASTER_GRAIN);
+  if (nw <= 1 || rows < nw) {
+    dl_replay_all(dl, c);
+    return (0);
+  }
+  t_band_replay *br = ft_malloc(sizeof(t_band_replay));
+  if (!br) {
+    dl_replay_all(dl, c);
+    return (0);
+  }
+  br->dl = dl;
+  br->c = c;
+  br->top = top;
+  parallel_for(rows, nw, band_replay_task, br);
+  for (int t = 0; c->damage && t < nw; t++)
+    for (int i = 0; i < br->damage[t].nrects; i++) {
+      const Rect *r = &br->damage[t].rects[i];
+      damage_merge(c->damage, r->x, r->y, r->x + r->w - 1, r->y + r->h - 1);
+    }
+  ft_free(br);
+  return (0);
+}
+
+int plt_displaylist_save(const DisplayList *dl, const char *path) {
+  if (!dl || !path || dl->failed) {
+    ft_printf("Error: plt_displaylist_save: nothing valid to save\n");
+    return (-1);
+  }
+  unsigned char hdr[16] = {'P', 'L', 'T', 'D'};
+  unsigned int version = PLT_DL_VERSION;
+  unsigned long long len = dl->buf.len;
+  ft_memcpy(hdr + 4, &version, 4);
+  ft_memcpy(hdr + 8, &len, 8);
+  struct iovec iov[2] = {{hdr, 16}, {dl->buf.data, dl->buf.len}};
+  return (write_file(path, iov, dl->buf.len ? 2 : 1));
+}
+
+#define PLT_DL_MAX_ARG 4096  // marker radius, tick count and legend row
+#define PLT_DL_MAX_GRID 1e6  // draw_axes walks its ranges in steps of 0.5
+#define PLT_DL_MAX_COORD 1e12 // where those steps are still exact
+
+// finite limits with a non-empty range on both axes
+static int dl_lim_ok(AxisLimits l) {
+  double s = l.xmin + l.xmax + l.ymin + l.ymax;
+  return (s - s == 0 && l.xmax != l.xmin && l.ymax != l.ymin);
+}
+
+// what a command's arg and limits may hold; the rest is checked by framing
+static int dl_cmd_ok(const t_dl_cmd *cmd) {
+  AxisLimits l = cmd->lim;
+  if (cmd->type == PLT_DL_LINE || cmd->type == PLT_DL_MARKERS) {
+    const double *v = (const double *)(cmd + 1);
+    for (long i = 0; i < 2 * cmd->n; i++)
+      if (v[i] == v[i] && v[i] - v[i] != 0) // infinite; NaN breaks the line
+        return (0);
+    return (dl_lim_ok(l) && (cmd->type == PLT_DL_LINE ||
+                             (cmd->arg >= -1 && cmd->arg <= PLT_DL_MAX_ARG)));
+  }
+  if (cmd->type == PLT_DL_LEGEND_ITEM)
+    return (cmd->arg >= 0 && cmd->arg <= PLT_DL_MAX_ARG);
+  if (cmd->type == PLT_DL_LEGEND_TEXT)
+    return (fabs(l.xmin) <= PLT_DL_MAX_ARG && fabs(l.ymin) <= PLT_DL_MAX_ARG);
+  if (cmd->type == PLT_DL_DRAW_AXES)
+    return (dl_lim_ok(l) && l.xmax - l.xmin <= PLT_DL_MAX_GRID &&
+            l.ymax - l.ymin <= PLT_DL_MAX_GRID &&
+            fabs(l.xmin) <= PLT_DL_MAX_COORD &&
+            fabs(l.ymin) <= PLT_DL_MAX_COORD);
+  if (cmd->type == PLT_DL_AXES2)
+    return (dl_lim_ok(l) && cmd->arg >= 1 && cmd->arg <= PLT_DL_MAX_ARG);
+  return (1);
+}
+
+// number of commands, or -1 if any of them is malformed
+static long dl_validate(const unsigned char *p, size_t len) {
+  long ncmds = 0;
+  size_t off = 0;
+  while (off < len) {
+    if (len - off < sizeof(t_dl_cmd))
+      return (-1);
+    const t_dl_cmd *cmd = (const t_dl_cmd *)(p + off);
+    size_t size = cmd->size, room = size - sizeof(t_dl_cmd);
+    if (size < sizeof(t_dl_cmd) || size % 8 || size > len - off ||
+        cmd->type < PLT_DL_LINE || cmd->type > PLT_DL_AXES2 || cmd->n < 0)
+      return (-1);
+    if (cmd->type == PLT_DL_LINE || cmd->type == PLT_DL_MARKERS) {
+      if ((size_t)cmd->n > room / (2 * sizeof(double)))
+        return (-1);
+    } else if (cmd->type >= PLT_DL_TITLE && cmd->type <= PLT_DL_LEGEND_TEXT) {
+      if (cmd->n < 1 || (size_t)cmd->n > room ||
+          p[off + sizeof(t_dl_cmd) + cmd->n - 1] != 0)
+        return (-1);
+    }
+    if (!dl_cmd_ok(cmd))
+      return (-1);
+    off += size;
+    ncmds++;
+  }
+  return (ncmds);
+}
+
+DisplayList *plt_displaylist_load(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    ft_printf("Error: plt_displaylist_load cannot open %s\n", path);
+    return (NULL);
+  }
+  unsigned char hdr[16];
+  unsigned int version = 0;
+  unsigned long long len = 0;
+  DisplayList *dl = NULL;
+  struct stat st;
+  ssize_t k = read(fd, hdr, 16);
+  if (k == 16 && hdr[0] == 'P' && hdr[1] == 'L' && hdr[2] == 'T' &&
+      hdr[3] == 'D' && fstat(fd, &st) == 0) {
+    ft_memcpy(&version, hdr + 4, 4);
+    ft_memcpy(&len, hdr + 8, 8);
+    if (version == PLT_DL_VERSION && len == (unsigned long long)st.st_size - 16)
+      dl = plt_displaylist_create();
+  }
+  if (dl && len && bytes_reserve(&dl->buf, (size_t)len) == 0) {
+    while (dl->buf.len < len) {
+      k = read(fd, dl->buf.data + dl->buf.len, (size_t)len - dl->buf.len);
+      if (k < 0 && errno == EINTR)
+        continue;
+      if (k <= 0)
+        break;
+      dl->buf.len += (size_t)k;
+    }
+  }
+  close(fd);
+  if (dl)
+    dl->ncmds = dl->buf.len == len ? dl_validate(dl->buf.data, dl->buf.len)
+                                   : -1;
+  if (!dl || dl->ncmds < 0) {
+    ft_printf("Error: plt_displaylist_load: %s is not a valid display list\n",
+              path);
+    plt_displaylist_destroy(dl);
+    return (NULL);
+  }
+  return (dl);
+}